@@ -0,0 +1,113 @@
+/*
+
+  gcbench.cpp: run the same workload under each collector mode
+  and report throughput and pause times.
+
+  usage: gcbench [ops [live-trees [huge-pages]]]
+
+  A table of live-trees small trees is kept; every op builds a
+  new tree and drops a random old one, and cmm_idle is called
+  now and then like a request loop would. Each mode gets a heap
+  of its own; trees go into the table with CMM_WRITE, which the
+  incremental, generational and concurrent modes need.
+  huge-pages is an enum cmm_huge (0 off, 1 transparent, 2
+  hugetlbfs), CMM_HUGE_PAGES overrides it; the backing in use is
+  reported per mode, as a heap may fall back to another.
+
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "cmm.h"
+#include "gcwork.h"
+
+#define DEPTH       4       /* 15 nodes per tree */
+#define IDLE_EVERY  1000    /* ops between cmm_idle calls */
+
+static table_t *table;
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + 1e-9*ts.tv_nsec;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+/* print the line of cmm_info starting with key */
+static void print_info_line(const char *info, const char *key)
+{
+    const char *l = strstr(info, key);
+    if (l)
+        printf("  %.*s\n", (int)strcspn(l, "\n"), l);
+}
+
+static void run(int mode, const char *name, long ops, long live, int huge)
+{
+    cmm_config_t cfg;
+    cmm_config_defaults(&cfg);
+    cfg.mode = mode;
+    if (huge >= 0)
+        cfg.huge_pages = huge;
+    cmm_heap_t *h = cmm_heap_create_ex(&cfg);
+    cmm_heap_select(h);
+
+    register_work_types();
+    table = (table_t *)cmm_allocv(mt_table, sizeof(table_t) + live*sizeof(node_t *));
+    table->n = live;
+    CMM_ROOT(table);
+
+    double *lat = (double *)malloc(ops*sizeof(double));
+    unsigned long seed = 1;
+    double t0 = now();
+    for (long i = 0; i < ops; i++) {
+        double t = now();
+        CMM_ENTER;
+        seed = seed*6364136223846793005UL + 1442695040888963407UL;
+        CMM_WRITE(table, slot[(seed>>33) % live], make_tree(DEPTH, i));
+        CMM_EXIT;
+        if (i % IDLE_EVERY == 0)
+            cmm_idle();
+        lat[i] = now() - t;
+    }
+    double total = now() - t0;
+
+    qsort(lat, ops, sizeof(double), cmp_double);
+    printf("%s:\n", name);
+    printf("  %.0f ops/s, latency p50 %.1f us, p99.9 %.1f us, max %.3f ms\n",
+           ops/total, 1e6*lat[ops/2], 1e6*lat[ops - ops/1000 - 1],
+           1e3*lat[ops - 1]);
+    char *info = cmm_info(2);
+    print_info_line(info, "Collector");
+    print_info_line(info, "GC pauses");
+    print_info_line(info, "Huge pages");
+    free(lat);
+
+    CMM_UNROOT(table);
+    cmm_heap_select(NULL);
+    cmm_heap_destroy(h);
+}
+
+int main(int argc, char **argv)
+{
+    long ops = argc > 1 ? atol(argv[1]) : 1000000;
+    long live = argc > 2 ? atol(argv[2]) : 20000;
+    int huge = argc > 3 ? atoi(argv[3]) : -1;   /* -1: cmm_huge_pages */
+
+    cmm_init(0, NULL, NULL);
+    run(cmm_mode_sync, "synchronous", ops, live, huge);
+    run(cmm_mode_snapshot, "snapshot", ops, live, huge);
+    run(cmm_mode_incremental, "incremental", ops, live, huge);
+    run(cmm_mode_generational, "generational", ops, live, huge);
+    run(cmm_mode_concurrent, "concurrent", ops, live, huge);
+    run(cmm_mode_mostly_concurrent, "mostly concurrent", ops, live, huge);
+    return 0;
+}
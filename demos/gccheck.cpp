@@ -0,0 +1,256 @@
+/*
+
+  gccheck.cpp: check that collects keep what is reachable, under
+  each collector mode, with the marking settings that change how
+  the collector traces, with a larger block size and with several
+  mutator threads.
+
+  usage: gccheck [ops [live-trees]]
+
+  A table of live-trees small trees is churned like in gcbench,
+  with a copy of the expected keys kept in malloc'ed memory.
+  After every round of ops and every collect each tree in the
+  table is walked and its keys compared; a tree the collector
+  lost has been cleared or reused and fails the check. Between
+  rounds the table, a large object, is grown and shrunk with
+  cmm_realloc. It hangs off a rooted small object, which a
+  generational heap soon makes old, so minor collects only reach
+  the new trees through the barrier on the table. With several mutators each registered thread churns
+  a table of its own, so collects stop threads in the middle of
+  their stores. Exits 1 at the first mismatch.
+
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "cmm.h"
+#include "gcwork.h"
+
+#define DEPTH       4       /* 15 nodes per tree */
+#define ROUNDS      6       /* rounds of ops, a resize after each */
+#define IDLE_EVERY  1000    /* ops between cmm_idle calls */
+#define MAX_MUTATORS 8
+
+typedef struct box {
+    table_t *t;
+} box_t;
+
+static void clear_box(box_t *b)
+{
+    b->t = NULL;
+}
+
+static void mark_box(box_t *b)
+{
+    CMM_MARK(b->t);
+}
+
+static mt_t mt_box;
+static CMM_TLS box_t *box;      /* the calling mutator's, rooted */
+static CMM_TLS long *keys;      /* expected key of each slot's tree */
+#define table (box->t)
+static const char *what;        /* the run being checked */
+
+static bool tree_ok(node_t *n, int depth, long key)
+{
+    if (!n || n->key != key)
+        return false;
+    if (depth == 1)
+        return !n->left && !n->right;
+    return tree_ok(n->left, depth - 1, 2*key) &&
+           tree_ok(n->right, depth - 1, 2*key + 1);
+}
+
+static void check(const char *when)
+{
+    for (long i = 0; i < table->n; i++)
+        if (!tree_ok(table->slot[i], DEPTH, keys[i])) {
+            fprintf(stderr, "%s: tree %ld lost %s\n", what, i, when);
+            exit(1);
+        }
+}
+
+static void set_slot(long i, long key)
+{
+    CMM_ENTER;
+    CMM_WRITE(table, slot[i], make_tree(DEPTH, key));
+    CMM_EXIT;
+    keys[i] = key;
+}
+
+/* resize the table to n slots, new slots get new trees; the
+   table is not left anchored, the box alone keeps it */
+static void resize(long n, long *key)
+{
+    CMM_ENTER;
+    long n0 = table->n;
+    if (n < n0)
+        table->n = n;
+    CMM_WRITE(box, t, (table_t *)cmm_realloc(table, sizeof(table_t) + n*sizeof(node_t *)));
+    keys = (long *)realloc(keys, n*sizeof(long));
+    if (n > n0) {
+        /* the trees are only marked below n */
+        memset(&table->slot[n0], 0, (n - n0)*sizeof(node_t *));
+        table->n = n;
+    }
+    for (long i = n0; i < n; i++)
+        set_slot(i, (*key)++);
+    CMM_EXIT;
+}
+
+/* collects of the heap in use so far, from cmm_info */
+static int collects(void)
+{
+    const char *l = strstr(cmm_info(2), "Collector");
+    const char *c = l ? strchr(l, ',') : NULL;
+    return c ? atoi(c + 1) : -1;
+}
+
+typedef struct churn {
+    cmm_heap_t   *heap;
+    long          ops, live;
+    unsigned long seed;
+} churn_t;
+
+/* fill a table, churn it and check it after each step */
+static void churn(churn_t *c)
+{
+    box = (box_t *)cmm_alloc(mt_box);
+    CMM_ROOT(box);
+    CMM_ENTER;
+    CMM_WRITE(box, t, (table_t *)cmm_allocv(mt_table, sizeof(table_t)));
+    CMM_EXIT;
+    keys = NULL;
+    long key = 1, ops = c->ops, live = c->live;
+    resize(live, &key);
+    check("after filling");
+
+    unsigned long seed = c->seed;
+    for (int r = 0; r < ROUNDS; r++) {
+        for (long i = 0; i < ops; i++) {
+            seed = seed*6364136223846793005UL + 1442695040888963407UL;
+            set_slot((seed>>33) % table->n, key++);
+            if (i % IDLE_EVERY == 0)
+                cmm_idle();
+        }
+        check("after ops");
+        /* the triggers (or pacing) must have fired by now */
+        if (r == 0 && collects() < 1) {
+            fprintf(stderr, "%s: no collect triggered\n", what);
+            exit(1);
+        }
+        cmm_collect_now();
+        check("after cmm_collect_now");
+
+        /* grow the large table, shrink it below large_threshold,
+           and back */
+        long n = r % 3 == 0 ? 2*live : r % 3 == 1 ? live/2 : live;
+        resize(n, &key);
+        check("after cmm_realloc");
+        cmm_collect_now();
+        check("after cmm_realloc and cmm_collect_now");
+    }
+    CMM_UNROOT(box);
+    free(keys);
+}
+
+static void *churn_thread(void *arg)
+{
+    churn_t *c = (churn_t *)arg;
+    cmm_thread_register();
+    cmm_heap_select(c->heap);
+    churn(c);
+    cmm_heap_select(NULL);
+    cmm_thread_unregister();
+    return NULL;
+}
+
+/* the live trees are shared out among the mutators */
+static void run(const char *name, cmm_config_t *cfg, int threads,
+                int mutators, long ops, long live)
+{
+    what = name;
+    int prev = cmm_mark_threads(threads);
+    cfg->mark_threads = threads;
+    cmm_heap_t *h = cmm_heap_create_ex(cfg);
+    cmm_heap_select(h);
+    register_work_types();
+    mt_box = CMM_REGTYPE("box", sizeof(box_t), clear_box, mark_box, 0);
+
+    churn_t c[MAX_MUTATORS];
+    for (int i = 0; i < mutators; i++) {
+        c[i].heap = h;
+        c[i].ops = ops;
+        c[i].live = live/mutators;
+        c[i].seed = i + 1;
+    }
+    if (mutators == 1) {
+        churn(&c[0]);
+    } else {
+        pthread_t th[MAX_MUTATORS];
+        for (int i = 0; i < mutators; i++)
+            if (pthread_create(&th[i], NULL, churn_thread, &c[i])) {
+                fprintf(stderr, "%s: cannot start mutator\n", what);
+                exit(1);
+            }
+        cmm_begin_blocking();
+        for (int i = 0; i < mutators; i++)
+            pthread_join(th[i], NULL);
+        cmm_end_blocking();
+    }
+    printf("ok %s\n", name);
+
+    cmm_heap_select(NULL);
+    cmm_heap_destroy(h);
+    cmm_mark_threads(prev);
+}
+
+static const char *names[] = {
+    "synchronous", "snapshot", "incremental", "generational",
+    "concurrent", "mostly concurrent" };
+
+/* run each mode with cfg, how is appended to the mode's name */
+static void run_modes(cmm_config_t *cfg, const char *how, int threads,
+                      int mutators, long ops, long live)
+{
+    char buf[80];
+    for (int m = cmm_mode_sync; m <= cmm_mode_mostly_concurrent; m++) {
+        snprintf(buf, sizeof(buf), "%s%s", names[m], how);
+        cfg->mode = m;
+        run(buf, cfg, threads, mutators, ops, live);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    long ops = argc > 1 ? atol(argv[1]) : 50000;
+    long live = argc > 2 ? atol(argv[2]) : 40000;
+
+    cmm_init(0, NULL, NULL);
+    cmm_config_t cfg;
+    cmm_config_defaults(&cfg);
+    run_modes(&cfg, "", 1, 1, ops, live);
+
+    /* a marking stack that is no power of two and overflows */
+    cfg.mark_stack = 5000;
+    run_modes(&cfg, ", mark_stack 5000", 1, 1, ops, live);
+    run_modes(&cfg, ", mark_stack 5000, 2 mark threads", 2, 1, ops, live);
+
+    /* blocks that hold more hunks than a select batch */
+    cmm_config_defaults(&cfg);
+    cfg.block_size = 16<<10;
+    run_modes(&cfg, ", 16 KB blocks", 1, 1, ops, live);
+
+    /* collects paced to the live volume instead of the triggers */
+    cmm_config_defaults(&cfg);
+    cfg.gc_percent = 100;
+    run_modes(&cfg, ", gc_percent 100", 1, 1, ops, live);
+
+    /* mutators stopped for collects while they churn */
+    cmm_config_defaults(&cfg);
+    run_modes(&cfg, ", 3 mutators, 2 mark threads", 2, 3, ops, live);
+    return 0;
+}
@@ -0,0 +1,74 @@
+/*
+
+  gcwork.h: the workload shared by gcbench and gccheck, a table
+  of small binary trees.
+
+  The table is variable-sized and marks its first n slots. Trees
+  are built with CMM_WRITE, as a collect may make a node old or
+  black before its subtrees are stored in it.
+
+ */
+
+#ifndef GCWORK_H
+#define GCWORK_H
+
+#include <string.h>
+
+#include "cmm.h"
+
+typedef struct node node_t;
+struct node {
+    node_t *left, *right;
+    long    key;
+};
+
+static void clear_node(node_t *n)
+{
+    n->left = n->right = NULL;
+    n->key = 0;
+}
+
+static void mark_node(node_t *n)
+{
+    CMM_MARK(n->left);
+    CMM_MARK(n->right);
+}
+
+typedef struct table {
+    long    n;
+    node_t *slot[];
+} table_t;
+
+static void clear_table(table_t *t, size_t s)
+{
+    memset(t, 0, s);
+}
+
+static void mark_table(table_t *t)
+{
+    for (long i = 0; i < t->n; i++)
+        CMM_MARK(t->slot[i]);
+}
+
+static mt_t mt_node, mt_table;
+
+/* register the types with the heap in use */
+static void register_work_types(void)
+{
+    mt_node = CMM_REGTYPE("node", sizeof(node_t), clear_node, mark_node, 0);
+    mt_table = CMM_REGTYPE("table", 0, clear_table, mark_table, 0);
+}
+
+/* a tree of depth levels, keys numbered from key like a heap */
+static node_t *make_tree(int depth, long key)
+{
+    node_t *n = (node_t *)cmm_alloc(mt_node);
+    n->key = key;
+    if (depth > 1) {
+        CMM_WRITE(n, left, make_tree(depth - 1, 2*key));
+        CMM_WRITE(n, right, make_tree(depth - 1, 2*key + 1));
+    }
+    return n;
+}
+
+#endif
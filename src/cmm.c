@@ -1 +0,0 @@
-cmm.cpp
\ No newline at end of file
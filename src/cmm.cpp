@@ -32,6 +32,7 @@ extern "C" {
 #endif 
 
 
+
 /*
  * Note: This implementation requires that malloc/realloc/calloc
  * deliver pointers that are 8-byte aligned (i.e., the lowest
@@ -77,20 +78,35 @@ extern "C" {
 #include <inttypes.h>
 #include <string.h>
 #include <assert.h>
+#if defined(__AVX2__) || defined(__SSE2__)
+#  include <immintrin.h>
+#endif
 #include <errno.h>
 #include <limits.h>
-#ifdef CMM_SNAPSHOT_GC
-#  include <sys/types.h>
-#  include <sys/wait.h>
-#  include <ctype.h>
-#  include <fcntl.h>
-#  include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <dirent.h>
+#include <ctype.h>
+#include <time.h>
+#ifdef __GLIBC__
+#include <malloc.h>
 #endif
 
 #define max(x,y)        ((x)<(y) ? (y) : (x))
 #define min(x,y)        ((x)<(y) ? (x) : (y))
-#define cmm_printf(...)  fprintf(stdlog, __VA_ARGS__)
+
+/* jea debug add fprintf(stdout, __VA_ARGS__) to line below */
+/*#define cmm_printf(...)  fprintf(stdlog, __VA_ARGS__) */
+#define cmm_printf(...) { fprintf(stdlog, __VA_ARGS__); fprintf(stdout, __VA_ARGS__); }
+
 #define debug(...)      cmm_debug_enabled ? (\
+        fprintf(stderr, "cmm(%s): ", C99__FUNC__), \
+        fprintf(stderr, __VA_ARGS__), \
         fprintf(stdlog, "cmm(%s): ", C99__FUNC__), \
         fprintf(stdlog, __VA_ARGS__), 0) : 1
 
@@ -103,12 +119,16 @@ extern "C" {
 #define PPTR(p)         ((uintptr_t)(p))
 
 #define PAGEBITS        12
-#define BLOCKBITS       PAGEBITS
 #if defined  PAGESIZE && (PAGESIZE != (1<<PAGEBITS))
 #  error Definitions related to PAGESIZE inconsistent
 #elif !defined PAGESIZE
 #  define PAGESIZE      (1<<PAGEBITS)
 #endif
+
+/* blocks are 2^block_bits bytes, a setting of each heap */
+#define MIN_BLOCKBITS   PAGEBITS
+#define MAX_BLOCKBITS   18
+#define BLOCKBITS       block_bits
 #define BLOCKSIZE       (1<<BLOCKBITS)
 
 
@@ -125,23 +145,36 @@ extern "C" {
 #define MIN_ROOTS       0x100
 #define MIN_STACK       0x1000
 #define MAX_VOLUME      (0x800000*sizeof(void *))    /* max volume threshold */
+#if UINTPTR_MAX > 0xffffffffUL
+#  define MAX_HEAPSIZE  ((size_t)64<<30)   /* address space reserved per heap */
+#else
+#  define MAX_HEAPSIZE  ((size_t)1<<30)
+#endif
 #define MAX_BLOCKS      (150*sizeof(void *))
-#define NUM_TRANSFER    (PIPE_BUF/sizeof(void *))
+#define MAX_MARK_STACK  (1<<26)      /* marking stack entries */
 #define NUM_IDLE_CALLS  100
-
-#define HMAP_NUM_BITS   4
+#define LOS_THRESHOLD   (256*1024)   /* default, see cmm_large_threshold */
+#define RETAIN_FREE     (MAX_BLOCKS*PAGESIZE)   /* default, see cmm_retain_free */
+/* the above are defaults, see cmm_config_defaults */
+#define TRIM_VOLUME     (1<<24)      /* malloc_trim after freeing this much */
+#define HUGE_SIZE       (1<<21)      /* huge page, see cmm_huge_pages */
+#define IDLE_SWEEP      64      /* blocks swept per cmm_idle call */
+#define MAX_PAUSE_US    500     /* default incremental slice */
+#define PACE_MIN        (1<<22) /* least allocation between paced collects */
+#define PACE_FLOOR      (1<<20) /* ... when held down by pace_limit */
+#define OLD_GROWTH      100     /* % the old generation grows between majors */
 
 #ifndef INT_MAX
 #  error INT_MAX not defined.
 #elif INT_MAX == 9223372036854775807L
-#  define HMAP_EPI       16
-#  define HMAP_EPI_BITS   4
+#  define HMAP_EPI       64
+#  define HMAP_EPI_BITS   6
 #elif INT_MAX == 2147483647
-#  define HMAP_EPI        8
-#  define HMAP_EPI_BITS   3
+#  define HMAP_EPI       32
+#  define HMAP_EPI_BITS   5
 #elif INT_MAX == 32767
-#  define HMAP_EPI        4
-#  define HMAP_EPI_BITS   2
+#  define HMAP_EPI       16
+#  define HMAP_EPI_BITS   4
 #else
 #  error Value of INT_MAX not supported.
 #endif
@@ -155,85 +188,376 @@ typedef struct block {
    struct block *next;
 } block_t;
 
+/* a block is on exactly one list, or the current block of its type */
+enum bl { bl_free, bl_partial, bl_full, bl_current, bl_unswept, bl_span, bl_released };
+
+#define HUNKS_PER_BLOCK  (BLOCKSIZE/MIN_HUNKSIZE)
+#define HMAP_WPB         (HUNKS_PER_BLOCK/HMAP_EPI)  /* words per plane */
+
+/* Heap map entry of a block: one bit per hunk in each plane, the
+ * planes of HMAP_WPB words one after the other, and the entries of
+ * the blocks likewise. Must agree with _cmm_alloc in cmm_private.h.
+ */
+enum plane { mbits, lbits, nbits };  /* managed, live (marked), notify */
+#define HMAP_PLANES      3
+#define HBLOCK_WORDS     (HMAP_PLANES*HMAP_WPB)
+#define HBLOCK_SIZE      (HBLOCK_WORDS*sizeof(unsigned int))
+#define HBLOCK(m, b)     ((m) + (b)*HBLOCK_WORDS)   /* of block b in map m */
+#define PLANE(hb, p)     ((hb) + (p)*HMAP_WPB)
+
+/* a byte per card of the heap, set by CMM_WRITE in a generational */
+/* heap; must agree with _cmm_write in cmm_private.h                */
+#define CARD_SHIFT       9
+#define CARDS_PER_BLOCK  (BLOCKSIZE >> CARD_SHIFT)
+
+/* a bit per block on free_b or released_b, for finding spans */
+#define FREE_EPW         ((long)(8*sizeof(unsigned long)))
+#define FREE_WORD(b)     (free_map[(b)/FREE_EPW])
+#define FREE_BIT(b)      (1UL << ((b) % FREE_EPW))
+#define FREE_MAPSIZE(n)  (((n)/FREE_EPW + 1)*sizeof(unsigned long))
+
 typedef struct blockrec {
    mt_t       t;            /* type directory entry    */
+   short      list;         /* which list block is on  */
+   char       young;        /* allocated from since the last collect */
    int        in_use;       /* number of object in use */
+   long       prev, next;   /* neighbours on the list  */
 } blockrec_t;
 
 typedef struct info {
    mt_t       t;            /* type of memory object   */
+   unsigned short flags;    /* INFO_LARGE              */
    uint32_t   nh;           /* size of memory object in multiples of MIN_HUNKSIZE !! */
 } info_t;
 
+#define INFO_LARGE   1      /* mapped on its own, see alloc_large */
+
 typedef struct typerec {
    char            *name;
    size_t          size;    /* zero when variable size */
    clear_func_t    *clear; 
    mark_func_t     *mark;
    finalize_func_t *finalize;
-   uintptr_t       current_a;     /* current address   */
-   uintptr_t       current_amax; 
-   int             next_b;        /* next block to try */
+   long            partial_b;     /* blocks with free hunks         */
+   long            full_b;        /* blocks without free hunks      */
+   long            unswept_b;     /* blocks not swept since collect */
+   long            nblocks;       /* blocks owned by this type      */
+   bool            span;          /* size class, see alloc_span     */
 } typerec_t;
 
-/* heap management */
-static size_t     heapsize;
-static size_t     hmapsize;
-static size_t     volume_threshold;
-static int        block_threshold;
-static int        num_blocks;
-static int        num_free_blocks;
-static blockrec_t *blockrecs = NULL;
-static char      *heap = NULL;
-static unsigned int *RESTRICTC99 hmap = NULL; /* bits for heap objects */
-static bool       heap_exhausted = false;
-
-static void *    * RESTRICTC99 managed;
-static int        man_size;
-static int        man_last = -1;
-static int        man_k = -1;
-static int        man_t = 0;
-static bool       man_is_compact = true;
-
-static void **   *RESTRICTC99 roots;
-static int        roots_last = -1;
-static int        roots_size;
-
-/* type registry */
-static typerec_t *types;
-static mt_t       types_last = -1;
-static mt_t       types_size;
-static int       *profile = NULL;
-static int        num_profiles = 0;
-
-/* the marking stack */
-static C99_CONST void *RESTRICTC99 *stack = NULL;
-static int        stack_size = MIN_STACK;
-static int        stack_last = -1;
-static bool       stack_overflowed  = false;
-static bool       stack_overflowed2 = false;
-
-/* other state variables */
-static int        num_allocs = 0;
-static int        num_alloc_blocks = 0;
-static int        num_collects = 0;
-static size_t     vol_allocs = 0;
-static bool       gc_disabled = false;
-static int        fetch_backlog = 0;
-static bool       collect_in_progress = false;
-static bool       mark_in_progress = false;
-static bool       collect_requested = false;
-static pid_t      collecting_child = 0;
-static notify_func_t *client_notify = NULL;
-static mt_t       marking_type = mt_undefined;
-static C99_CONST void *marking_object = NULL;
-static FILE *     stdlog = NULL;
+/* Allocation cursor, one per thread and memory type. The
+ * thread owns the current block, so it may look for runs in it
+ * without locking. [a, end) is a run of free objects in the
+ * current block that has already been accounted for (in_use,
+ * num_allocs, vol_allocs), so handing out an object is a
+ * pointer bump plus setting its managed bit.
+ * Must agree with struct cmm_cursor in cmm_private.h.
+ */
+typedef struct cursor {
+   char            *a;       /* next free object in run */
+   char            *end;     /* end of run              */
+   size_t          size;
+   clear_func_t    *clear;
+   uintptr_t       current_a;     /* where to look for the next run */
+   uintptr_t       current_amax;  /* last object address in block   */
+   long            current_b;     /* block allocated from, or -1    */
+} cursor_t;
+
+struct mutator;
+
+/* a registered mutator thread, see cmm_thread_register */
+typedef struct thread {
+   struct thread   *next;
+   struct mutator  *muts;        /* one per heap used  */
+   cmm_heap_t      *current;     /* heap selected      */
+} thread_t;
+
+/* what a thread keeps per heap it uses, see use_heap */
+typedef struct mutator {
+   struct mutator  *next;        /* mutators of the same heap */
+   struct mutator  *next_of_thread;
+   cmm_heap_t      *h;
+   thread_t        *th;
+   cursor_t        *curs;        /* indexed by type */
+   int             num_curs;
+   struct cmm_stack *transients;
+   C99_CONST void  **satb;       /* shaded by CMM_WRITE, see shade_concurrent */
+   int             satb_n;
+} mutator_t;
+
+/* what a snapshot collect shares with its child, see collect_snapshot */
+typedef struct snapshot {
+   void           *map;          /* MAP_SHARED */
+   size_t          size;
+   unsigned int   *marks;        /* the child's hmap, for [0, top) */
+   size_t          msize;
+   size_t         *live;         /* live volume */
+   unsigned char  *man_live;     /* live bits of managed[0..man_k] */
+   long            top;          /* heap_top at the fork */
+   long            b;            /* next block to sweep */
+   long            i;            /* next managed[] entry to sweep */
+   bool            done;         /* the child is done, sweep */
+} snapshot_t;
+
+/*
+ * A heap has its own type registry, roots and thresholds and
+ * is collected on its own. Its fields are accessed through the
+ * macros below, which refer to the heap selected by the calling
+ * thread (cur_heap).
+ */
+struct cmm_heap {
+   /* heap management */
+   size_t     heapsize;
+   size_t     hmapsize;         /* bytes */
+   size_t     volume_threshold;
+   long       block_threshold;
+   long       cfg_block_threshold;   /* as configured, 0: derived */
+   size_t     cfg_volume_threshold;
+   int        pace_percent;     /* pacing, 0: fixed thresholds */
+   size_t     pace_limit;       /* soft limit of heap_goal, 0: none */
+   size_t     live_bytes;       /* found by the last mark */
+   size_t     heap_goal;        /* live_bytes + allocation until next collect */
+   long       num_blocks;
+   long       heap_top;         /* blocks from here on never used */
+   long       num_free_blocks;
+   long       free_b;           /* list of free blocks */
+   long       released_b;       /* free blocks not backed by memory */
+   long       num_released;
+   size_t     retain_target;    /* free bytes kept when releasing */
+   size_t     released_total;   /* bytes returned to the system */
+   size_t     offheap_freed;    /* bytes freed since last malloc_trim */
+   long       num_unswept;      /* blocks on unswept lists */
+   long       span_hint;        /* where to look for free spans */
+   unsigned long *free_map;     /* free blocks, see FREE_WORD */
+   blockrec_t *blockrecs;
+   char      *heap;
+   long       block_bits;       /* see BLOCKBITS */
+   long       max_blocks;       /* blocks reserved */
+   int        huge_mode;        /* enum cmm_huge */
+   size_t     page_unit;        /* of commit and release */
+   unsigned int *hmap;          /* bits for heap objects, see HBLOCK */
+   unsigned char *cards;        /* dirty cards, see CMM_WRITE */
+   unsigned int live_flip;      /* polarity of live bits */
+   bool       heap_exhausted;
+
+   void *    * RESTRICTC99 managed;
+   unsigned char *man_dirty;    /* managed[i] stored into, see CMM_WRITE */
+   long       man_size;
+   long       man_last;
+   long       man_k;            /* last entry when collect started */
+   bool       man_is_compact;
+   long   *** pagemap;          /* managed[] index by address */
+   size_t     pm_size;          /* bytes */
+   size_t     los_threshold;    /* map objects this big on their own */
+   size_t     los_size;         /* bytes mapped for large objects */
+   int        los_count;
+
+   void **   *RESTRICTC99 roots;
+   int        roots_last;
+   int        roots_size;
+
+   /* type registry */
+   typerec_t *types;
+   mt_t       types_last;
+   mt_t       types_size;
+   int       *profile;
+   int        num_profiles;
+
+   /* the marking stack */
+   C99_CONST void *RESTRICTC99 *stack;
+   int        stack_size;
+   int        stack_last;
+   bool       stack_overflowed;
+   bool       stack_overflowed2;
+
+   /* other state variables */
+   int        num_allocs;
+   long       num_alloc_blocks;
+   int        num_collects;
+   size_t     vol_allocs;
+   int        fetch_backlog;
+   int        idle_period;      /* cmm_idle calls between idle collects */
+   int        gc_mode;          /* enum cmm_mode */
+   bool       collect_in_progress;
+   bool       mark_in_progress;
+   bool       collect_requested;
+   pid_t      collecting_child;
+   int        pfd_garbage[2];   /* collecting child signals here */
+   snapshot_t snap;             /* its marks */
+   bool       incr_marking;     /* marking in slices */
+   long       slice_us;         /* length of a slice */
+   double     slice_due;        /* earliest start of the next slice */
+   bool       minor_collect;    /* generational, old objects stay marked */
+   size_t     old_limit;        /* live volume that makes a major collect */
+   long       old_man_limit;    /* ... and number of managed[] entries */
+   int        num_majors;
+   bool       conc_marking;     /* the heap's marker thread is marking */
+   bool       conc_drained;     /* ... and ran out of grey once */
+   bool       conc_quit;
+   bool       conc_started;     /* conc_thread exists */
+   int        conc_clears;      /* soft_dirty_clears at the start */
+   pthread_t  conc_thread;
+   pthread_cond_t conc_wake;    /* signals it grey objects or quit */
+   struct marker *conc;         /* its grey objects */
+   C99_CONST void **conc_in;    /* ... handed to it by other threads */
+   long       num_conc_in;
+   long       size_conc_in;
+   int        num_pauses;       /* world stopped by the collector */
+   double     pause_total;      /* seconds */
+   double     pause_max;
+   notify_func_t *client_notify;
+   mt_t       marking_type;
+   C99_CONST void *marking_object;
+   FILE *     stdlog;
+
+   mutator_t *mutators;         /* threads using this heap */
+};
+
+static cmm_heap_t *default_heap = NULL;
+static CMM_TLS cmm_heap_t *cur_heap = NULL;
+
+#define heapsize            (cur_heap->heapsize)
+#define hmapsize            (cur_heap->hmapsize)
+#define volume_threshold    (cur_heap->volume_threshold)
+#define block_threshold     (cur_heap->block_threshold)
+#define cfg_block_threshold (cur_heap->cfg_block_threshold)
+#define cfg_volume_threshold (cur_heap->cfg_volume_threshold)
+#define pace_percent        (cur_heap->pace_percent)
+#define pace_limit          (cur_heap->pace_limit)
+#define live_bytes          (cur_heap->live_bytes)
+#define heap_goal           (cur_heap->heap_goal)
+#define num_blocks          (cur_heap->num_blocks)
+#define heap_top            (cur_heap->heap_top)
+#define num_free_blocks     (cur_heap->num_free_blocks)
+#define free_b              (cur_heap->free_b)
+#define released_b          (cur_heap->released_b)
+#define num_released        (cur_heap->num_released)
+#define retain_target       (cur_heap->retain_target)
+#define released_total      (cur_heap->released_total)
+#define offheap_freed       (cur_heap->offheap_freed)
+#define num_unswept         (cur_heap->num_unswept)
+#define span_hint           (cur_heap->span_hint)
+#define free_map            (cur_heap->free_map)
+#define blockrecs           (cur_heap->blockrecs)
+#define heap                (cur_heap->heap)
+#define block_bits          (cur_heap->block_bits)
+#define max_blocks          (cur_heap->max_blocks)
+#define huge_mode           (cur_heap->huge_mode)
+#define page_unit           (cur_heap->page_unit)
+#define hmap                (cur_heap->hmap)
+#define cards               (cur_heap->cards)
+#define live_flip           (cur_heap->live_flip)
+#define heap_exhausted      (cur_heap->heap_exhausted)
+#define managed             (cur_heap->managed)
+#define man_size            (cur_heap->man_size)
+#define man_dirty           (cur_heap->man_dirty)
+#define man_last            (cur_heap->man_last)
+#define man_k               (cur_heap->man_k)
+#define man_is_compact      (cur_heap->man_is_compact)
+#define pagemap             (cur_heap->pagemap)
+#define pm_size             (cur_heap->pm_size)
+#define los_threshold       (cur_heap->los_threshold)
+#define los_size            (cur_heap->los_size)
+#define los_count           (cur_heap->los_count)
+#define roots               (cur_heap->roots)
+#define roots_last          (cur_heap->roots_last)
+#define roots_size          (cur_heap->roots_size)
+#define types               (cur_heap->types)
+#define types_last          (cur_heap->types_last)
+#define types_size          (cur_heap->types_size)
+#define profile             (cur_heap->profile)
+#define num_profiles        (cur_heap->num_profiles)
+#define stack               (cur_heap->stack)
+#define stack_size          (cur_heap->stack_size)
+#define stack_last          (cur_heap->stack_last)
+#define stack_overflowed    (cur_heap->stack_overflowed)
+#define stack_overflowed2   (cur_heap->stack_overflowed2)
+#define num_allocs          (cur_heap->num_allocs)
+#define num_alloc_blocks    (cur_heap->num_alloc_blocks)
+#define num_collects        (cur_heap->num_collects)
+#define vol_allocs          (cur_heap->vol_allocs)
+#define fetch_backlog       (cur_heap->fetch_backlog)
+#define idle_period         (cur_heap->idle_period)
+#define gc_mode             (cur_heap->gc_mode)
+#define collect_in_progress (cur_heap->collect_in_progress)
+#define mark_in_progress    (cur_heap->mark_in_progress)
+#define collect_requested   (cur_heap->collect_requested)
+#define collecting_child    (cur_heap->collecting_child)
+#define pfd_garbage         (cur_heap->pfd_garbage)
+#define snap                (cur_heap->snap)
+#define incr_marking        (cur_heap->incr_marking)
+#define slice_us            (cur_heap->slice_us)
+#define slice_due           (cur_heap->slice_due)
+#define minor_collect       (cur_heap->minor_collect)
+#define old_limit           (cur_heap->old_limit)
+#define old_man_limit       (cur_heap->old_man_limit)
+#define num_majors          (cur_heap->num_majors)
+#define conc_marking        (cur_heap->conc_marking)
+#define conc_drained        (cur_heap->conc_drained)
+#define conc_quit           (cur_heap->conc_quit)
+#define conc_started        (cur_heap->conc_started)
+#define conc_clears         (cur_heap->conc_clears)
+#define conc_thread         (cur_heap->conc_thread)
+#define conc_wake           (cur_heap->conc_wake)
+#define conc                (cur_heap->conc)
+#define conc_in             (cur_heap->conc_in)
+#define num_conc_in         (cur_heap->num_conc_in)
+#define size_conc_in        (cur_heap->size_conc_in)
+#define num_pauses          (cur_heap->num_pauses)
+#define pause_total         (cur_heap->pause_total)
+#define pause_max           (cur_heap->pause_max)
+#define client_notify       (cur_heap->client_notify)
+#define marking_type        (cur_heap->marking_type)
+#define marking_object      (cur_heap->marking_object)
+#define stdlog              (cur_heap->stdlog)
+#define mutators            (cur_heap->mutators)
+
+static CMM_TLS bool gc_disabled = false;
+static int        huge_pages = cmm_huge_off;  /* for new heaps */
 bool              cmm_debug_enabled = false;
 
+/* mutator threads */
+static pthread_mutex_t cmm_lock;      /* recursive */
+static pthread_cond_t  world_stopped;
+static pthread_cond_t  world_resumed;
+static thread_t  *threads = NULL;
+static int        num_threads = 0;
+static int        num_parked = 0;
+static thread_t  *stopping = NULL;    /* thread that stopped the world */
+static int        stop_depth = 0;
+static int        conc_tracing = 0;   /* marker threads in a batch */
+bool              _cmm_stop_requested = false;  /* __atomic, read unlocked */
+int               _cmm_marking = 0;   /* heaps marking in slices or concurrently */
+static CMM_TLS thread_t  *self = NULL;
+static CMM_TLS mutator_t *me = NULL;  /* self in cur_heap */
+static CMM_TLS int lock_depth = 0;
+
+/* copies of what the inline allocator in cmm_private.h needs */
+CMM_TLS char         *_cmm_heap = NULL;
+CMM_TLS unsigned int *_cmm_hmap = NULL;
+CMM_TLS int           _cmm_block_bits = 0;
+CMM_TLS cursor_t     *_cmm_cursors = NULL;  /* me->curs */
+CMM_TLS int           _cmm_num_cursors = 0;
+CMM_TLS unsigned char *_cmm_cards = NULL;   /* of generational heaps */
+CMM_TLS size_t        _cmm_num_cards = 0;
+#define cursors   _cmm_cursors
+
+#define LOCK   do { pthread_mutex_lock(&cmm_lock); lock_depth++; } while (0)
+#define UNLOCK do { lock_depth--; pthread_mutex_unlock(&cmm_lock); } while (0)
+
 /* transient object stack */
 typedef C99_CONST void    *stack_elem_t; 
 typedef stack_elem_t  *stack_ptr_t;
-typedef struct stack cmmstack_t;
+typedef struct cmm_stack cmmstack_t;
+
+ /* dump() calling d and ds(cmmstack_t) debug macros */
+#ifndef NDEBUG
+#define d()   dump(__FUNCTION__,__LINE__,0)
+#define ds(st) dump(__FUNCTION__,__LINE__,st)
+#else
+#define d() 
+#define ds(st)
+#endif
 
 static cmmstack_t   *make_stack(void);
 static void         stack_push(cmmstack_t *, stack_elem_t);
@@ -245,7 +569,7 @@ static stack_elem_t stack_elt(cmmstack_t *, int);
 
 static mt_t       mt_stack;
 static mt_t       mt_stack_chunk;
-cmmstack_t * C99_CONST _cmm_transients;
+CMM_TLS cmmstack_t *_cmm_transients;  /* me->transients */
 
 /*
  * CMM's little helpers
@@ -275,19 +599,31 @@ cmmstack_t * C99_CONST _cmm_transients;
 #define UNMARK_LIVE(p)     { p = (void *)((uintptr_t)(p) & ~BITL); }
 #define UNMARK_NOTIFY(p)   { p = (void *)((uintptr_t)(p) & ~BITN); }
 
-#define HMAP(a, op, b) (hmap[(((uintptr_t)(a))>>(ALIGN_NUM_BITS + HMAP_EPI_BITS))] op \
-                        ((b) << (((((uintptr_t)(a))>>ALIGN_NUM_BITS) & (HMAP_EPI-1)) * HMAP_NUM_BITS)))
-#define HMAP_LIVE(a)       HMAP(a, &, BITL)
-#define HMAP_NOTIFY(a)     HMAP(a, &, BITN)
-#define HMAP_MANAGED(a)    HMAP(a, &, BITM)
+/* p is the plane: mbits, lbits or nbits */
+#define HMAP_WIDX(a)       ((((uintptr_t)(a))>>(ALIGN_NUM_BITS + HMAP_EPI_BITS)) & (HMAP_WPB-1))
+/* the word of a as if each block had one plane, plus the other */
+/* planes of the blocks before a's and the planes before p        */
+#define HMAP_WORD(a, p)    hmap[(((uintptr_t)(a))>>(ALIGN_NUM_BITS + HMAP_EPI_BITS)) + \
+                                (((HMAP_PLANES-1)*(((uintptr_t)(a))>>BLOCKBITS) + (p)) << \
+                                 (BLOCKBITS - ALIGN_NUM_BITS - HMAP_EPI_BITS))]
+#define HMAP_BIT(a)        (1u << ((((uintptr_t)(a))>>ALIGN_NUM_BITS) & (HMAP_EPI-1)))
+#define HMAP(a, op, p)     (HMAP_WORD(a, p) op HMAP_BIT(a))
+
+/* A hunk is live when its live bit differs from live_flip, which
+ * flips with every collect. Survivors thus need no unmarking; the
+ * live bits of fresh runs are reset in set_run instead.
+ */
+#define HMAP_LIVE(a)       ((HMAP_WORD(a, lbits) ^ live_flip) & HMAP_BIT(a))
+#define HMAP_NOTIFY(a)     HMAP(a, &, nbits)
+#define HMAP_MANAGED(a)    HMAP(a, &, mbits)
 
-#define HMAP_MARK_LIVE(a)     HMAP(a, |=, BITL)
-#define HMAP_MARK_NOTIFY(a)   HMAP(a, |=, BITN)
-#define HMAP_MARK_MANAGED(a)  HMAP(a, |=, BITM)
+#define HMAP_MARK_LIVE(a)     (live_flip ? HMAP(a, &=~, lbits) : HMAP(a, |=, lbits))
+#define HMAP_MARK_NOTIFY(a)   HMAP(a, |=, nbits)
+#define HMAP_MARK_MANAGED(a)  HMAP(a, |=, mbits)
 
-#define HMAP_UNMARK_LIVE(a)     HMAP(a, &=~, BITL)
-#define HMAP_UNMARK_NOTIFY(a)   HMAP(a, &=~, BITN)
-#define HMAP_UNMARK_MANAGED(a)  HMAP(a, &=~, BITM)
+#define HMAP_UNMARK_LIVE(a)     (live_flip ? HMAP(a, |=, lbits) : HMAP(a, &=~, lbits))
+#define HMAP_UNMARK_NOTIFY(a)   HMAP(a, &=~, nbits)
+#define HMAP_UNMARK_MANAGED(a)  HMAP(a, &=~, mbits)
 
 #define LBITS(p)           ((uintptr_t)(p) & (MIN_HUNKSIZE-1))
 #define CLRPTR(p)          ((void *)((((uintptr_t)(p)) & ~(MIN_HUNKSIZE-1))))
@@ -308,15 +644,19 @@ cmmstack_t * C99_CONST _cmm_transients;
 
 #define ABORT_WHEN_OOM(p)  if (!(p)) { warn("allocation failed\n"); abort(); }
 
+/* offset of the last object of size s in a block */
+#define AMAX(s) ((s) >= (size_t)BLOCKSIZE ? 0 : (BLOCKSIZE/(s) - 1)*(s))
+
 /* loop over all managed addresses in small object heap */
 /* NOTE: the real address is 'heap + a', b is the block */
 #define DO_HEAP(a, b) { \
-   uintptr_t __a = 0; \
-   for (int b = 0; b < num_blocks; b++, __a += BLOCKSIZE) { \
-      if (blockrecs[b].in_use > 0) { \
-         uintptr_t __a_next = __a + BLOCKSIZE; \
-         for (uintptr_t a = __a; a < __a_next; a += MIN_HUNKSIZE) { \
-            if (HMAP_MANAGED(a))
+   uintptr_t __v[SELECT_MAX]; \
+   for (long b = 0; b < heap_top; b++) { \
+      int __n; \
+      for (uintptr_t __o = 0; blockrecs[b].in_use > 0 && \
+              (__n = block_select(b, sel_managed, 0, __v, &__o)); ) \
+      for (int __k = 0; __k < __n; __k++) { \
+         uintptr_t a = __v[__k]; (void)a; {
 
 #define DO_HEAP_END }}}}
 
@@ -324,8 +664,8 @@ cmmstack_t * C99_CONST _cmm_transients;
 /* NOTE: the real address is 'managed[i]', which is not */
 /* a cleared address (use CLRPTR to clear)             */ 
 #define DO_MANAGED(i) { \
-  int __lasti = collect_in_progress ? man_k : man_last; \
-  for (int i = 0; i <= __lasti; i++) { \
+  long __lasti = collect_in_progress ? man_k : man_last; \
+  for (long i = 0; i <= __lasti; i++) { \
 
 #define DO_MANAGED_END }}
 
@@ -335,13 +675,14 @@ cmmstack_t * C99_CONST _cmm_transients;
 
 #define ENABLE_GC gc_disabled = __nogc;
 
-#ifdef CMM_SNAPSHOT_GC
 STATICFUNC void cmm_collect(void);
-STATICFUNC int fetch_unreachables(void);
-#else
-#  define cmm_collect()          /* noop */
-#  define fetch_unreachables()  /* noop */
-#endif
+STATICFUNC int  collect_sync(bool minor);
+STATICFUNC int  fetch_unreachables(bool wait);
+STATICFUNC void mark_increment(void);
+STATICFUNC void end_concurrent(void);
+STATICFUNC void flush_satb(mutator_t *m);
+STATICFUNC double clock_now(void);
+
 
 //STATICFUNC void *seal(C99_CONST char *p)
 STATICFUNC void *seal(C99_CONST void *p)
@@ -363,440 +704,1226 @@ STATICFUNC void *unseal(C99_CONST void *p)
    return (void *)pc;
 }
 
+/* info of the object at p in a slot of span type t, see alloc_span */
+#define SPAN_INFO(p, t)  ((info_t *)((char *)(p) + types[t].size - MIN_HUNKSIZE))
+
+/* type of the object at heap offset a */
+static inline mt_t heap_type(uintptr_t a)
+{
+   mt_t t = blockrecs[BLOCKA(a)].t;
+   return types[t].span ? SPAN_INFO(heap + a, t)->t : t;
+}
+
 STATICFUNC void check_num_free_blocks(void)
 {
-   int n = 0;
-   for (int b=0; b < num_blocks; b++)
+   long n = num_blocks - heap_top;
+   for (long b=0; b < heap_top; b++) {
+     assert(!(FREE_WORD(b) & FREE_BIT(b)) == (blockrecs[b].t != mt_undefined));
      if (blockrecs[b].t == mt_undefined)
         n++;
+   }
    assert(n==num_free_blocks);
-}
 
-STATICFUNC int _find_managed(C99_CONST void *p);
-STATICFUNC bool live(C99_CONST void *p)
-{
-   ptrdiff_t a = ((char *)p) - heap;
-   if (a>=0 && (unsigned long)a<heapsize) {
-      assert(HMAP_MANAGED(a));
-      return HMAP_LIVE(a);
+   n = num_blocks - heap_top;
+   for (long b = free_b; b != -1; b = blockrecs[b].next) {
+      assert(blockrecs[b].list == bl_free);
+      n++;
    }
-   int i = _find_managed(p);
-   assert(i != -1);
-   return LIVE(managed[i]);
+   for (long b = released_b; b != -1; b = blockrecs[b].next) {
+      assert(blockrecs[b].list == bl_released);
+      n++;
+   }
+   assert(n==num_free_blocks);
 }
 
-STATICFUNC void mark_live(C99_CONST void *p)
+/*
+ * Block lists are doubly linked through the block records.
+ * Free blocks are on free_b, or on released_b when their memory
+ * was given back. Blocks of type t are either the current block
+ * of some thread's cursor or on types[t].partial_b,
+ * types[t].full_b or, between a collect and their sweep,
+ * types[t].unswept_b. Blocks from heap_top on have never been
+ * used, their records are zero and on no list. The lists are
+ * shared by all threads and must only be touched with cmm_lock
+ * held.
+ */
+
+STATICFUNC long *block_list(long b)
 {
-   ptrdiff_t a = ((char *)p) - heap;
-   if (a>=0 && (unsigned long)a<heapsize) {
-      assert(HMAP_MANAGED(a));
-      HMAP_MARK_LIVE(a);
-      return;
+   switch (blockrecs[b].list) {
+   case bl_free:    return &free_b;
+   case bl_released: return &released_b;
+   case bl_partial: return &types[blockrecs[b].t].partial_b;
+   case bl_full:    return &types[blockrecs[b].t].full_b;
+   case bl_unswept: return &types[blockrecs[b].t].unswept_b;
+   default:         return NULL;
    }
-   int i = _find_managed(p);
-   assert(i != -1);
-   MARK_LIVE(managed[i]);
 }
 
-STATICFUNC void maybe_trigger_collect(size_t s)
+STATICFUNC void block_unlink(long b)
 {
-   num_allocs += 1;
-   vol_allocs += s;
-   if (gc_disabled || collect_in_progress)
-      return;
+   blockrec_t *br = &blockrecs[b];
+   long *head = block_list(b);
 
-   if (num_alloc_blocks >= block_threshold || 
-       vol_allocs >= volume_threshold      ||
-       collect_requested) {
-#ifdef CMM_SNAPSHOT_GC      
-      if (num_free_blocks < block_threshold) {
-         warn("running low on memory, doing synchronous GC\n");
-         cmm_collect_now();
-      } else {
-         cmm_collect();
-         if (!collect_in_progress)
-            /* could not spawn child, do it synchronously */
-            cmm_collect_now();
-      }
-#else
-      cmm_collect_now();
-#endif
+   if (!head) {
+      /* only the owner ever frees its current block */
+      assert(cursors[br->t].current_b == b);
+      cursors[br->t].current_b = -1;
+      return;
    }
+   if (br->prev != -1)
+      blockrecs[br->prev].next = br->next;
+   else
+      *head = br->next;
+   if (br->next != -1)
+      blockrecs[br->next].prev = br->prev;
+   if (br->list == bl_unswept)
+      num_unswept--;
+   else if (br->list == bl_released)
+      num_released--;
+   if (br->list == bl_free || br->list == bl_released)
+      FREE_WORD(b) &= ~FREE_BIT(b);
 }
 
-#define AMAX(s) ((BLOCKSIZE/(s) - 1)*(s))
- 
-/* scan small object heap for next free hunk                 */
-/* update current_a field for type t, return true on success */  
-STATICFUNC bool _update_current_a(mt_t t, typerec_t *tr, uintptr_t s, uintptr_t a)
+STATICFUNC void block_push(long b, short list)
 {
-   if (blockrecs[BLOCKA(a)].t != t)
-      goto search_for_block;
+   blockrec_t *br = &blockrecs[b];
+   br->list = list;
+   long *head = block_list(b);
+
+   br->prev = -1;
+   br->next = *head;
+   if (*head != -1)
+      blockrecs[*head].prev = b;
+   *head = b;
+   if (list == bl_unswept)
+      num_unswept++;
+   else if (list == bl_released)
+      num_released++;
+   if (list == bl_free || list == bl_released)
+      FREE_WORD(b) |= FREE_BIT(b);
+}
 
-search_in_block:
-   /* search for next free hunk in block */
-   while (a <= tr->current_amax && HMAP_MANAGED(a))
-      a += s;
-   if (a <= tr->current_amax) {
-      tr->current_a = a;
-      return true;
+STATICFUNC long block_pop(long *head)
+{
+   long b = *head;
+   if (b != -1) {
+      *head = blockrecs[b].next;
+      if (*head != -1)
+         blockrecs[*head].prev = -1;
+      FREE_WORD(b) &= ~FREE_BIT(b);
    }
+   return b;
+}
 
-search_for_block:
-   /* search for another block with free hunks */
-   ;
-   int b = tr->next_b;
-   int orig_b = (b+num_blocks-1) % num_blocks;
-
-   while (b != orig_b) {
-      if (blockrecs[b].t == mt_undefined) {
-         assert(blockrecs[b].in_use == 0);
-         blockrecs[b].t = t;
-         VALGRIND_CREATE_BLOCK(heap + a, BLOCKSIZE, types[t].name);
-         tr->current_a = a = b*BLOCKSIZE;
-         tr->current_amax = a + AMAX(s);
-         tr->next_b = (b == num_blocks) ? 1 : b+1;
-         num_alloc_blocks++;
-         num_free_blocks--;
-         return true;
-
-      } else if (blockrecs[b].t==t && blockrecs[b].in_use<(long)(BLOCKSIZE/s)) {
-         a = b*BLOCKSIZE;
-         tr->current_amax = a + AMAX(s);
-         tr->next_b = (b == num_blocks) ? 1 : b+1;
-         goto search_in_block;
-      }
-      b = (b+1) % num_blocks;
+/* return block b of type t, and the rest of its span, to the free list */
+STATICFUNC void free_block(long b)
+{
+   typerec_t *tr = &types[blockrecs[b].t];
+   long n = tr->size > (size_t)BLOCKSIZE ? tr->size/BLOCKSIZE : 1;
+   block_unlink(b);
+   for (long k = b; k < b + n; k++) {
+      tr->nblocks--;
+      blockrecs[k].t = mt_undefined;
+      blockrecs[k].in_use = 0;
+      block_push(k, bl_free);
+      num_free_blocks++;
    }
-
-   /* no free hunk found */
-   assert(b == orig_b);
-   heap_exhausted = true;
-   tr->current_a = 0;
-   tr->current_amax = AMAX(s);
-   tr->next_b = 0;
-   return false;
 }
 
-STATICFUNC bool update_current_a(mt_t t)
-{
-   typerec_t *tr = &types[t];
+/*
+ * The heap, its map and block records are reserved for max_blocks
+ * blocks up front and committed as the heap grows, so none of them
+ * ever moves and INHEAP stays a range compare against heapsize.
+ */
 
-   if (blockrecs[BLOCKA(tr->current_a)].t == t) {
-      tr->current_a += tr->size;
-      if (tr->current_a <= tr->current_amax) {
-         if (!HMAP_MANAGED(tr->current_a))
-            return true;
-      } else
-         tr->current_a -= tr->size;
-   }   
-   return _update_current_a(t, tr, tr->size, tr->current_a);
-}
+#define UNIT_DOWN(n)  ((n) & ~(uintptr_t)(page_unit-1))
+#define UNIT_UP(n)    UNIT_DOWN((n) + page_unit-1)
 
-/* allocate from small-object heap if possible */
-STATICFUNC void *alloc_fixed_size(mt_t t)
+/*
+ * With huge pages, ranges are reserved HUGE_SIZE-aligned and
+ * committed and released in whole huge pages. Transparent huge
+ * pages are asked for with MADV_HUGEPAGE. A hugetlbfs heap is
+ * mapped in full right away, as its pages come from a pool set
+ * aside by the administrator and cannot be committed lazily.
+ */
+STATICFUNC void *reserve(size_t n, bool tlb)
 {
-   if (collect_in_progress && !collecting_child)
-      return NULL;
+   n = UNIT_UP(n);
+   if (tlb) {
+      void *p = mmap(NULL, n, PROT_READ|PROT_WRITE,
+                     MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB, -1, 0);
+      return p == MAP_FAILED ? NULL : p;
+   }
 
-   if (heap_exhausted || !update_current_a(t))
+   size_t pad = page_unit > PAGESIZE ? page_unit : 0;
+   char *p = (char *)mmap(NULL, n + pad, PROT_NONE,
+                          MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+   if (p == MAP_FAILED)
       return NULL;
-
-   void *p = heap + types[t].current_a;
-   VALGRIND_MEMPOOL_ALLOC(heap, p, types[t].size);
-   blockrecs[BLOCKA(types[t].current_a)].in_use++;
-   
+   if (pad) {
+      char *q = (char *)UNIT_UP((uintptr_t)p);
+      if (q > p)
+         munmap(p, q - p);
+      if (p + pad > q)
+         munmap(q + n, p + pad - q);
+      madvise(q, n, MADV_HUGEPAGE);
+      p = q;
+   }
    return p;
 }
 
-/* allocate with malloc */
-STATICFUNC void *alloc_variable_sized(mt_t t, size_t s)
+STATICFUNC void unreserve(void *p, size_t n)
 {
-   info_t *info = (info_t*)0;
+   if (p)
+      munmap(p, UNIT_UP(n));
+}
 
-   /* make sure s is a multiple of MIN_HUNKSIZE */
-   assert(s%MIN_HUNKSIZE == 0);
+/* make bytes [n0, n1) of the reserved range at p usable */
+STATICFUNC bool commit(void *p, size_t n0, size_t n1)
+{
+   n0 = UNIT_UP(n0);
+   n1 = UNIT_UP(n1);
+   return n1 <= n0 || mprotect((char *)p + n0, n1 - n0, PROT_READ|PROT_WRITE) == 0;
+}
 
+/* commit blocks [b0, b1) */
+STATICFUNC bool commit_blocks(long b0, long b1)
+{
+   return commit(hmap, b0*HBLOCK_SIZE, b1*HBLOCK_SIZE) &&
+      commit(blockrecs, b0*sizeof(blockrec_t), b1*sizeof(blockrec_t)) &&
+      commit(cards, b0*CARDS_PER_BLOCK, b1*CARDS_PER_BLOCK) &&
+      commit(free_map, b0/8, FREE_MAPSIZE(b1)) &&
+      commit(heap, b0*BLOCKSIZE, b1*BLOCKSIZE);
+}
 
-   if (s > CMM_SIZE_MAX) {
-      warn("size exceeds CMM_SIZE_MAX\n");
-      abort();
+/* collect triggers as configured or else derived from the heap size */
+/*
+ * Pacing
+ *
+ * Pacing is off unless gc_percent is set (cmm_gc_percent or
+ * CMM_GC_PERCENT); collects are then due at the triggers, as
+ * configured or derived from the heap size. With pacing on and no
+ * triggers configured, a collect is due when the volume allocated
+ * since the last one reaches pace_percent percent of what that one
+ * found live, but at least PACE_MIN bytes (like GOGC). The heap
+ * then peaks at about heap_goal. A pace_limit (soft maximum heap)
+ * below that goal lowers it, but it stays max(live/16, PACE_FLOOR)
+ * bytes above the live volume, so a live set near the limit is not
+ * collected back to back.
+ */
+STATICFUNC void set_thresholds(void)
+{
+   if (pace_percent && !cfg_block_threshold && !cfg_volume_threshold) {
+      size_t goal = live_bytes + max(live_bytes/100*pace_percent, (size_t)PACE_MIN);
+      if (pace_limit && goal > pace_limit)
+         goal = max(pace_limit, live_bytes + max(live_bytes/16, (size_t)PACE_FLOOR));
+      heap_goal = goal;
+      volume_threshold = goal - live_bytes;
+      block_threshold = LONG_MAX;
+      return;
    }
-  
-   void *p = NULL;
-   /* don't allocate from heap when t==mt_stack */
-   if (t && types[t].size>=s && BLOCKSIZE>=s)
-      if ((p = alloc_fixed_size(t)))
-         goto fetch_and_return;
-   
-malloc:
-   p = malloc(s + MIN_HUNKSIZE);  // + space for info
+   block_threshold = cfg_block_threshold ? cfg_block_threshold :
+      min((long)MAX_BLOCKS, num_blocks/3);
+   volume_threshold = cfg_volume_threshold ? cfg_volume_threshold :
+      min(MAX_VOLUME, heapsize/2);
+   heap_goal = 0;
+}
 
-   if (!p && collecting_child) {
-      if (gc_disabled)
-         warn("low memory and GC disabled\n");
-      else /* try to recover */
-         while (collecting_child)
-            fetch_unreachables();
-      goto malloc; 
+/* add at least n free blocks to the heap, cmm_lock held */
+STATICFUNC bool grow_heap(long n)
+{
+   long k = min(max(n, num_blocks/2), max_blocks - num_blocks);
+   while (k >= n && !commit_blocks(num_blocks, num_blocks + k))
+      k /= 2;
+   if (k < n) {
+      debug("cannot grow heap by %ld blocks\n", n);
+      return false;
    }
-   if (!p)
-      return NULL;
-
-   assert(!LBITS(p));
-
-   info = (info_t*)p;
-   info->t = t;
-   info->nh = s/MIN_HUNKSIZE;
-   p = seal(p);
 
-fetch_and_return:
-#ifdef CMM_SNAPSHOT_GC
-   if (collecting_child)
-      fetch_unreachables();
-#endif
-   maybe_trigger_collect(s);
-   return p;
+   VALGRIND_MAKE_MEM_NOACCESS(heap + heapsize, k*BLOCKSIZE);
+   num_free_blocks += k;
+   num_blocks += k;
+   hmapsize = num_blocks*HBLOCK_SIZE;
+   heapsize = num_blocks*BLOCKSIZE;
+   set_thresholds();
+   debug("heap grown to %ld blocks\n", num_blocks);
+   return true;
 }
 
-// printf("address 0x%"PRIxPTR" (in block %d) is marked live\n", PPTR(heap + a), b);
-//    translates to
-// printf("address 0x%""l" "x"" (in block %d) is marked live\n", ((uintptr_t)(heap + a)), b);
-
-STATICFUNC bool no_marked_live(void)
+/* put n blocks from heap_top on released_b, low addresses first */
+STATICFUNC bool fresh_blocks(long n)
 {
-   uintptr_t __a = 0;
-   for (int b = 0; b < num_blocks; b++, __a += BLOCKSIZE) {
-      uintptr_t __a_next = __a + BLOCKSIZE;
-      for (uintptr_t a = __a; a < __a_next; a += MIN_HUNKSIZE) {
-         if (HMAP_LIVE(a)) {
-            warn("address 0x%lx (in block %d) is marked live\n", PPTR(heap + a), b);
-            printf("address 0x%lx (in block %d) is marked live\n", PPTR(heap + a), b);
-            printf("address(%p) + (216 decimal, aka 0xd8 hex) bytes --> %p had values: 0x%x hex, or %d decimal. \n", (heap+a), ((heap + a) + 216), *((heap + a) + 216), *((heap + a) + 216) );
-            printf("address(%p) + (248 decimal, aka 0xf8 hex) bytes --> %p had values: 0x%x hex, or %d decimal. \n", (heap+a), ((heap + a) + 248), *((heap + a) + 248), *((heap + a) + 248) );
-	    assert(0); 
-            return false;
-         }
-      }
-   }
-
-   for (int i = 0; i <= man_last; i++) {
-      if (LIVE(managed[i])) {
-         void *p = CLRPTR(managed[i]);
-         warn("address 0x%lx is marked live\n", PPTR(p));
-         return false;
-      }
+   if (heap_top + n > num_blocks && !grow_heap(heap_top + n - num_blocks))
+      return false;
+   for (long b = heap_top + n - 1; b >= heap_top; b--) {
+      blockrecs[b].t = mt_undefined;
+      blockrecs[b].in_use = 0;
+      block_push(b, bl_released);
    }
-
+   heap_top += n;
    return true;
 }
 
+/* give the pages of free blocks [b0, b1) back to the system */
+STATICFUNC void release_run(long b0, long b1)
+{
+   uintptr_t a0 = UNIT_UP(b0*BLOCKSIZE);
+   uintptr_t a1 = UNIT_DOWN(b1*BLOCKSIZE);
+   if (a0 < a1)
+      madvise(heap + a0, a1 - a0, MADV_DONTNEED);
+
+   /* hmap pages covering released blocks only */
+   uintptr_t h0 = UNIT_UP(b0*HBLOCK_SIZE);
+   uintptr_t h1 = UNIT_DOWN(b1*HBLOCK_SIZE);
+   if (h0 < h1)
+      madvise((char *)hmap + h0, h1 - h0, MADV_DONTNEED);
+}
 
-/* 
- * Sort managed array in-place using poplar sort.
- * Information Processing Letters 39, pp 269-276, 1991.
+/*
+ * Release free blocks but the retain_target bytes' worth freed
+ * last. Nothing happens until twice that much is free, so a heap
+ * hovering around the target does not give back and refault the
+ * same pages over and over.
+ */
+STATICFUNC void release_free_blocks(void)
+{
+   long keep = retain_target/BLOCKSIZE;
+   if (num_free_blocks - num_released - (num_blocks - heap_top) <= 2*keep)
+      return;
+   /* hugetlbfs pages stay with the heap */
+   if (huge_mode == cmm_huge_tlbfs)
+      return;
 
- * Rationale: poplar sort has O(N log N) upper bound on worst case complexity,
-    and is an in-situ sort, so it is preferrable to quicksort (worst case N^2 complexity)
-    and is acceptable for realtime systems. 
+   long b = free_b, lo = heap_top, hi = -1, n = 0;
+   for (long k = 0; b != -1 && k < keep; k++)
+      b = blockrecs[b].next;
+   while (b != -1) {
+      long next = blockrecs[b].next;
+      block_unlink(b);
+      block_push(b, bl_released);
+      lo = min(lo, b);
+      hi = max(hi, b);
+      n++;
+      b = next;
+   }
 
-    For arrays that are almost sorted already, poplar sort is much 
-    faster than heapsort and competitive with quicksort.
+   /* coalesce with released neighbours into runs */
+   while (lo > 0 && blockrecs[lo-1].list == bl_released)
+      lo--;
+   for (long b0 = lo; b0 <= hi; b0++) {
+      if (blockrecs[b0].list != bl_released)
+         continue;
+      long b1 = b0 + 1;
+      while (b1 < heap_top && blockrecs[b1].list == bl_released)
+         b1++;
+      release_run(b0, b1);
+      b0 = b1;
+   }
+   released_total += n*BLOCKSIZE;
+   debug("released %ld blocks\n", n);
+}
 
+/*
+ * Word-at-a-time hmap scanning
+ *
+ * The planes of a block are tested a word at a time and
+ * __builtin_ctz finds the next hunk. Blocks of objects that
+ * span a word or more are stepped at the object size instead.
  */
 
-#define MAX_POPLAR 31
-static int   poplar_roots[MAX_POPLAR+2] = {-1};
-static bool  poplar_sorted[MAX_POPLAR];
+#define HMAP_STRIDE_MIN   (HMAP_EPI*MIN_HUNKSIZE)   /* step objects from here */
 
-#define M(p,q) (((p)+(q))/2)
-#define A(q)   (managed[q])
+enum sel { sel_managed, sel_live, sel_dead };
 
-#define SWAP(i,j)             \
-{                             \
-   void *p = managed[i];      \
-   managed[i] = managed[j];   \
-   managed[j] = p;            \
+/* word i of block b's hunks picked by sel, live bits read with flip */
+static inline unsigned int hmap_select(unsigned int *hb, int i, enum sel sel,
+                                       unsigned int flip)
+{
+   switch (sel) {
+   case sel_live: return PLANE(hb, mbits)[i] & (PLANE(hb, lbits)[i] ^ flip);
+   case sel_dead: return PLANE(hb, mbits)[i] & ~(PLANE(hb, lbits)[i] ^ flip);
+   default:       return PLANE(hb, mbits)[i];
+   }
 }
 
-STATICFUNC void sift(int p, int q)
+/* first word from i in plane w that is not zero, or HMAP_WPB */
+STATICFUNC int hmap_skip(unsigned int *w, int i)
 {
-   if (q-p > 1) {
-      int x = q;
-      int m = M(p,q);
-      if (A(q-1) > A(x)) x = q-1;
-      if (A(m) > A(x)) x = m;
-
-      if (x != q) {
-         SWAP(x,q);
-	 if (x == q-1) sift(m, x); else sift(p, x);
-      }
+#if defined(__AVX2__) && HMAP_EPI == 32
+   for (; i + 8 <= HMAP_WPB; i += 8) {
+      __m256i x = _mm256_loadu_si256((__m256i *)(w + i));
+      if (!_mm256_testz_si256(x, x))
+         break;
    }
+#elif defined(__SSE2__) && HMAP_EPI == 32
+   __m128i z = _mm_setzero_si128();
+   for (; i + 4 <= HMAP_WPB; i += 4) {
+      __m128i x = _mm_loadu_si128((__m128i *)(w + i));
+      if (_mm_movemask_epi8(_mm_cmpeq_epi32(x, z)) != 0xFFFF)
+         break;
+   }
+#endif
+   while (i < HMAP_WPB && !w[i])
+      i++;
+   return i;
 }
 
-/* increment man_k to man_last while maintaining the poplar invariant */
-STATICFUNC void update_man_k(void)
+/* first hunk from a to a_max, stepping s, whose managed bit */
+/* is set (or clear); a value beyond a_max when there is none */
+STATICFUNC uintptr_t hmap_find(uintptr_t a, uintptr_t a_max, uintptr_t s, bool set)
 {
-   assert(!collect_in_progress);
-#  define r poplar_roots
-
-   while (man_k < man_last) {
-      man_k++;
-      if ((man_t>=2) && (man_k-1+r[man_t-2] == 2*r[man_t-1])) {
-         r[--man_t] = man_k;
-         sift(r[man_t-1], man_k);
-         poplar_sorted[man_t-1] = false;
-      } else {
-         r[++man_t] = man_k;
-         poplar_sorted[man_t-1] = true;
-      }
+   if (s != MIN_HUNKSIZE) {
+      while (a <= a_max && !HMAP_MANAGED(a) == set)
+         a += s;
+      return a;
+   }
+   /* find first set (or zero) bit */
+   const uintptr_t span = HMAP_EPI*MIN_HUNKSIZE;
+   while (a <= a_max) {
+      unsigned int w = HMAP_WORD(a, mbits);
+      if (!set)
+         w = ~w;
+      w &= ~0u << ((a>>ALIGN_NUM_BITS) & (HMAP_EPI-1));
+      if (w)
+         return min(a_max + s, (a & ~(span - 1)) + __builtin_ctz(w)*MIN_HUNKSIZE);
+      a = (a & ~(span - 1)) + span;
    }
-#  undef r
+   return a_max + s;
 }
 
-/* sort a single poplar using poplar sort ;-) */
-STATICFUNC void sort_poplar(int n)
+/* Blocks may hold more hunks than fit a buffer on the stack, so */
+/* they are handed out SELECT_MAX at a time, the hunks of the      */
+/* smallest block, and callers loop until none are left:          */
+/*    for (uintptr_t o = 0; (n = block_select(b, .., v, &o)); )    */
+#define SELECT_MAX   ((1<<MIN_BLOCKBITS)/MIN_HUNKSIZE)
+
+/* store offsets of up to SELECT_MAX hunks of block b picked by sel */
+/* in v, from offset *o in the block on, which is advanced; return  */
+/* their number, 0 when done; hb holds the bits, normally in hmap    */
+STATICFUNC int hblock_select(long b, unsigned int *hb, enum sel sel, unsigned int flip,
+                             uintptr_t *v, uintptr_t *o)
 {
-   assert(!collect_in_progress);
-   
-   if (poplar_sorted[n]) return;
-
-   int r[MAX_POPLAR+1], t = 1;
-   r[0] = poplar_roots[n];
-   r[1] = poplar_roots[n+1];
-   
-   /* sort, right to left, by always taking the max root */
-   int k = r[1]+1;
-   while (--k > r[0]) {
-
-      /* move maximum element to the right */
-      int m = t;
-      for (int j=1; j<t; j++)
-	 if (A(r[m]) < A(r[j])) m = j;
-      
-      if (m != t) {
-	 SWAP(r[m], r[t]);
-	 sift(r[m-1], r[m]);
-      }
-      
-      if (r[t-1] == k-1) {
-	 t--;
-      } else {
-	 r[t] = M(r[t-1],k);
-	 r[++t] = k-1;
-      }
+   int n = 0;
+   size_t s = types[blockrecs[b].t].size;
+   uintptr_t a0 = b*BLOCKSIZE;
+
+   if (s >= HMAP_STRIDE_MIN) {
+      uintptr_t a_max = a0 + AMAX(s);
+      uintptr_t a = a0 + *o;
+      for (; a <= a_max && n < SELECT_MAX; a += s)
+         if (hmap_select(hb, HMAP_WIDX(a), sel, flip) & HMAP_BIT(a))
+            v[n++] = a;
+      *o = a - a0;
+      return n;
    }
-   poplar_sorted[n] = true;
-}
 
-#undef A
-#undef M
-#undef SWAP
+   int i = hmap_skip(PLANE(hb, mbits), *o/HMAP_STRIDE_MIN);
+   for (; i < HMAP_WPB && n + HMAP_EPI <= SELECT_MAX;
+        i = hmap_skip(PLANE(hb, mbits), i + 1))
+      for (unsigned int m = hmap_select(hb, i, sel, flip); m; m &= m - 1)
+         v[n++] = a0 + (i*HMAP_EPI + __builtin_ctz(m))*MIN_HUNKSIZE;
+   *o = (uintptr_t)i*HMAP_STRIDE_MIN;
+   return n;
+}
 
-/* Remove obsolete entries from managed. */
-STATICFUNC void compact_managed(void)
+STATICFUNC int block_select(long b, enum sel sel, unsigned int flip, uintptr_t *v,
+                            uintptr_t *o)
 {
-   assert(!collect_in_progress);
+   return hblock_select(b, HBLOCK(hmap, b), sel, flip, v, o);
+}
 
-   if (man_is_compact) return;
+/* set live bits of hunks [a, e) of one block to marked or unmarked */
+STATICFUNC void hmap_set_live(uintptr_t a, uintptr_t e, bool live)
+{
+   unsigned int f = live ? ~live_flip : live_flip;
+   const uintptr_t span = HMAP_EPI*MIN_HUNKSIZE;
+   while (a < e) {
+      uintptr_t stop = min(e, (a & ~(span - 1)) + span);
+      int n = (stop - a)>>ALIGN_NUM_BITS;
+      unsigned int m = (n == HMAP_EPI ? ~0u : (1u << n) - 1)
+                       << ((a>>ALIGN_NUM_BITS) & (HMAP_EPI-1));
+      unsigned int *w = &HMAP_WORD(a, lbits);
+      /* markers may mark in the same word meanwhile */
+      if (f)
+         __atomic_or_fetch(w, m, __ATOMIC_RELAXED);
+      else
+         __atomic_and_fetch(w, ~m, __ATOMIC_RELAXED);
+      a = stop;
+   }
+}
 
-   /* every poplar is sorted, so we set man_k to the last element */
-   /* of the first poplar and recompute the poplar roots quickly  */
-   assert(man_t > 0);
-   man_k = poplar_roots[1];
+/*
+ * Lazy sweeping
+ *
+ * A collect only sweeps blocks of types with a finalizer and
+ * spans, whose objects may have one. All other blocks in use go
+ * on the unswept list of their type and are swept when the
+ * allocator wants to take a block of that type or needs a free
+ * one, or from cmm_idle. Their marks are only valid until the
+ * next mark, so all blocks must be swept before it (finish_sweep).
+ */
 
-   int i, n = 0;
-   for (i = 0; i <= man_k; i++) {
-      if (!OBSOLETE(managed[i]))
-         managed[n++] = managed[i];
-   }
-   man_k = n-1;
-   for (; i <= man_last; i++) {
-      if (!OBSOLETE(managed[i]))
-         managed[n++] = managed[i];
-   }
-   man_last = n-1;
+/* sweep block b from an unswept list, cmm_lock held */
+STATICFUNC void sweep_block(long b)
+{
+   blockrec_t *br = &blockrecs[b];
+   assert(br->list == bl_unswept);
 
-   /* rebuild poplars */
-#if 1
-   {
-      /* this only works when managed was sorted up to man_k */
-      n = man_k + 1;
-      man_t = 0;
-      poplar_roots[man_t] = -1;
-      int m = (1<<(MAX_POPLAR-1))-1;
-      while (n) {
-         if (n >= m) {
-            poplar_roots[man_t+1] = poplar_roots[man_t] + m;
-            poplar_sorted[man_t] = true;
-            man_t++;
-            n -= m;
-         } else
-            m = m>>1;
+   /* other threads may set notify bits meanwhile */
+   size_t s = types[br->t].size;
+   /* marks are from the last collect, before live_flip flipped */
+   /* (generational collects leave it alone)                     */
+   assert(!collect_in_progress);
+   uintptr_t v[SELECT_MAX];
+   unsigned int flip = gc_mode == cmm_mode_generational ? live_flip : ~live_flip;
+   int n;
+   for (uintptr_t o = 0; (n = block_select(b, sel_dead, flip, v, &o)); ) {
+      for (int k = 0; k < n; k++) {
+         uintptr_t a = v[k];
+         if (HMAP_NOTIFY(a)) {
+            __atomic_and_fetch(&HMAP_WORD(a, nbits), ~HMAP_BIT(a), __ATOMIC_RELAXED);
+            client_notify(heap + a);
+         }
+         HMAP_UNMARK_MANAGED(a);
+         VALGRIND_MEMPOOL_FREE(heap, heap + a);
+         assert(br->in_use > 0);
+         br->in_use--;
       }
    }
-#else
-   man_k = -1;
-   man_t = 0;
-   update_man_k();
-#endif
-   
-   /* shrink when much bigger than necessary */
-   if (man_last*4<man_size && man_size > MIN_MANAGED) {
-      man_size /= 2;
-      debug("shrinking managed table to %d\n", man_size);
-      managed = (void **)realloc(managed, man_size*sizeof(void *));
-      assert(managed);
+
+   if (br->in_use == 0) {
+      free_block(b);
+      VALGRIND_DISCARD((block_t *)(heap + b*BLOCKSIZE));
+   } else {
+      block_unlink(b);
+      block_push(b, br->in_use < (long)(BLOCKSIZE/s) ? bl_partial : bl_full);
    }
-   man_is_compact = true;
 }
 
-
-/* binary search in sorted part of managed */
-STATICFUNC int bsearch_managed(C99_CONST void *p, int l, int r)
+/* sweep up to n blocks, return true when unswept blocks remain */
+STATICFUNC bool sweep_some(int n)
 {
-   while (r-l > 1) {
-      int n = (r+l)/2;
-      if (p >= managed[n])
-         l = n;
-      else
-         r = n;
-   }
-   if (CLRPTR(managed[l]) == p)
-      return l;
-
-   else if (l<man_k && (CLRPTR(managed[l+1]) == p))
-      return l+1;
+   for (int t = 0; t <= types_last && n > 0; t++)
+      while (types[t].unswept_b != -1 && n-- > 0)
+         sweep_block(types[t].unswept_b);
+   return num_unswept > 0;
+}
 
-   else 
-      return -1;
+STATICFUNC void finish_sweep(void)
+{
+   while (sweep_some(INT_MAX))
+      ;
 }
 
-STATICFUNC int _find_managed(C99_CONST void *p)
+/* put all blocks in use of types without finalizer on unswept lists, */
+/* after a minor collect only those allocated from since the last one */
+STATICFUNC void defer_sweep(void)
 {
-   int i = -1;
-   for (int n = 0; n<man_t && i<0; n++) {
-      if (!poplar_sorted[n]) sort_poplar(n);
-      i = bsearch_managed(p, poplar_roots[n]+1, poplar_roots[n+1]+1);
+   if (minor_collect) {
+      for (long b = 0; b < heap_top; b++) {
+         blockrec_t *br = &blockrecs[b];
+         typerec_t *tr = &types[br->t];
+         if (!br->young || br->in_use == 0 || tr->finalize || tr->span ||
+             (br->list != bl_partial && br->list != bl_full))
+            continue;
+         block_unlink(b);
+         block_push(b, bl_unswept);
+      }
+      return;
    }
-
-   if (i==-1 || collect_in_progress) {
-      /* do linear search on excess part */
-      for (int n = man_last; n > man_k; n--)
-         if (CLRPTR(managed[n]) == p) {
-            i = n;
-            break;
-         }
+   for (int t = 0; t <= types_last; t++) {
+      typerec_t *tr = &types[t];
+      if (tr->finalize || tr->span)
+         continue;
+      long b;
+      while ((b = block_pop(&tr->partial_b)) != -1)
+         block_push(b, bl_unswept);
+      while ((b = block_pop(&tr->full_b)) != -1)
+         block_push(b, bl_unswept);
    }
-   return i;
+}
+
+/*
+ * Threads and safepoints
+ *
+ * Every thread that uses LIBCMM is registered and has its own
+ * transient stack and allocation cursors. Collections stop the
+ * world: the collecting thread raises _cmm_stop_requested and
+ * waits until all other threads are parked in cmm_safepoint,
+ * which is called from allocation slow paths and may be called
+ * by the application (CMM_SAFEPOINT). Threads with GC disabled
+ * do not park. A thread about to block outside LIBCMM (I/O, join,
+ * condition waits) brackets that with cmm_begin_blocking() and
+ * cmm_end_blocking() and counts as parked meanwhile.
+ */
+
+/* wait for the world to resume, cmm_lock held exactly once */
+STATICFUNC void park(void)
+{
+   assert(lock_depth == 1);
+   num_parked++;
+   pthread_cond_broadcast(&world_stopped);
+   while (_cmm_stop_requested)
+      pthread_cond_wait(&world_resumed, &cmm_lock);
+   num_parked--;
+}
+
+/* bring all other threads to a safepoint, cmm_lock held */
+STATICFUNC void stop_world(void)
+{
+   if (_cmm_stop_requested && stopping == self) {
+      stop_depth++;
+      return;
+   }
+   assert(lock_depth == 1);
+   while (_cmm_stop_requested)
+      park();
+   __atomic_store_n(&_cmm_stop_requested, true, __ATOMIC_RELEASE);
+   stopping = self;
+   stop_depth = 1;
+   while (num_parked < num_threads - 1 || conc_tracing > 0)
+      pthread_cond_wait(&world_stopped, &cmm_lock);
+}
+
+STATICFUNC void start_world(void)
+{
+   assert(stopping == self);
+   if (--stop_depth > 0)
+      return;
+   stopping = NULL;
+   __atomic_store_n(&_cmm_stop_requested, false, __ATOMIC_RELEASE);
+   pthread_cond_broadcast(&world_resumed);
+}
+
+void cmm_safepoint(void)
+{
+   if (!__atomic_load_n(&_cmm_stop_requested, __ATOMIC_ACQUIRE) ||
+       gc_disabled || stopping == self)
+      return;
+   LOCK;
+   if (_cmm_stop_requested)
+      park();
+   UNLOCK;
+}
+
+void cmm_begin_blocking(void)
+{
+   if (!self)
+      return;
+   LOCK;
+   num_parked++;
+   pthread_cond_broadcast(&world_stopped);
+   UNLOCK;
+}
+
+void cmm_end_blocking(void)
+{
+   if (!self)
+      return;
+   LOCK;
+   while (_cmm_stop_requested)
+      pthread_cond_wait(&world_resumed, &cmm_lock);
+   num_parked--;
+   UNLOCK;
+}
+
+/* make room in this thread's cursors for all registered types */
+STATICFUNC void grow_cursors(void)
+{
+   int n = _cmm_num_cursors;
+   cursors = (cursor_t *)realloc(cursors, types_size*sizeof(cursor_t));
+   ABORT_WHEN_OOM(cursors);
+   memset(cursors + n, 0, (types_size - n)*sizeof(cursor_t));
+   for (; n < types_size; n++)
+      cursors[n].current_b = -1;
+   _cmm_num_cursors = types_size;
+   me->curs = cursors;
+   me->num_curs = _cmm_num_cursors;
+}
+
+/* give runs and current blocks of mutator m back, cmm_lock held */
+STATICFUNC void release_cursors(mutator_t *m)
+{
+   assert(m->h == cur_heap);
+   for (int t = 0; t < m->num_curs; t++) {
+      cursor_t *c = &m->curs[t];
+      if (c->a < c->end) {
+         uintptr_t a = c->a - heap;
+         int n = (c->end - c->a)/c->size;
+         assert(blockrecs[BLOCKA(a)].in_use >= n);
+         blockrecs[BLOCKA(a)].in_use -= n;
+      }
+      c->a = c->end = NULL;
+      if (c->current_b != -1) {
+         long b = c->current_b;
+         assert(blockrecs[b].list == bl_current);
+         if (blockrecs[b].in_use < (long)(BLOCKSIZE/types[t].size))
+            block_push(b, bl_partial);
+         else
+            block_push(b, bl_full);
+         c->current_b = -1;
+      }
+   }
+}
+
+/* give unused runs and current blocks of all threads back */
+STATICFUNC void retire_cursors(void)
+{
+   assert(stopping == self);
+   for (mutator_t *m = mutators; m; m = m->next)
+      release_cursors(m);
+}
+
+STATICFUNC long _find_managed(C99_CONST void *p);
+STATICFUNC bool live(C99_CONST void *p)
+{
+   ptrdiff_t a = ((char *)p) - heap;
+   if (a>=0 && (unsigned long)a<heapsize) {
+      assert(HMAP_MANAGED(a));
+      return HMAP_LIVE(a);
+   }
+   long i = _find_managed(p);
+   assert(i != -1);
+   return LIVE(managed[i]);
+}
+
+STATICFUNC void mark_live(C99_CONST void *p)
+{
+   ptrdiff_t a = ((char *)p) - heap;
+   if (a>=0 && (unsigned long)a<heapsize) {
+      assert(HMAP_MANAGED(a));
+      HMAP_MARK_LIVE(a);
+      return;
+   }
+   long i = _find_managed(p);
+   assert(i != -1);
+   MARK_LIVE(managed[i]);
+}
+
+STATICFUNC void maybe_trigger_collect(size_t s)
+{
+   if (s) {
+      __atomic_add_fetch(&num_allocs, 1, __ATOMIC_RELAXED);
+      __atomic_add_fetch(&vol_allocs, s, __ATOMIC_RELAXED);
+   }
+   if (gc_disabled)
+      return;
+   if (collecting_child) {
+      /* reclaim some of what the snapshot collect found */
+      fetch_unreachables(false);
+      return;
+   }
+   if (incr_marking) {
+      if (clock_now() >= slice_due)
+         mark_increment();
+      return;
+   }
+   if (conc_marking) {
+      /* or the mutators outran the marker, halved as a paced */
+      /* heap's block_threshold is LONG_MAX                    */
+      if (conc_drained ||
+          num_alloc_blocks/2 >= block_threshold ||
+          vol_allocs/2 >= volume_threshold)
+         end_concurrent();
+      return;
+   }
+   if (collect_in_progress)
+      return;
+
+   if (num_alloc_blocks >= block_threshold || 
+       vol_allocs >= volume_threshold      ||
+       collect_requested) {
+      cmm_collect();
+   }
+}
+
+/* hand the run [a, e) of free objects of type t to its cursor */
+STATICFUNC void set_run(mt_t t, cursor_t *c, uintptr_t a, uintptr_t e)
+{
+   size_t s = types[t].size;
+   int n = (e - a)/s;
+
+   c->a = heap + a;
+   c->end = heap + e;
+   c->size = s;
+   c->clear = types[t].clear;
+   c->current_a = e;
+   hmap_set_live(a, e, conc_marking);   /* allocate black */
+   blockrecs[BLOCKA(a)].young = 1;
+   blockrecs[BLOCKA(a)].in_use += n;
+   __atomic_add_fetch(&num_allocs, n, __ATOMIC_RELAXED);
+   __atomic_add_fetch(&vol_allocs, n*s, __ATOMIC_RELAXED);
+}
+
+/* scan small object heap for the next run of free hunks      */
+/* and hand it to the cursor for type t, return true on success */
+STATICFUNC bool refill_cursor(mt_t t)
+{
+   cursor_t *c = &cursors[t];
+   uintptr_t s = types[t].size;
+   uintptr_t a = c->current_a;
+
+   if (c->current_b == -1)
+      goto search_for_block;
+
+search_in_block:
+   /* search for next free hunk in block, then for the end of the run */
+   a = hmap_find(a, c->current_amax, s, false);
+   if (a <= c->current_amax) {
+      uintptr_t e = a + s;
+      /* objects must be counted one by one while profiling */
+      if (!profile)
+         e = hmap_find(e, c->current_amax, s, true);
+      set_run(t, c, a, e);
+      return true;
+   }
+
+search_for_block:
+   /* current block is used up, take a partially filled one */
+   /* of the same type or else a free one                   */
+   ;
+   typerec_t *tr = &types[t];
+   LOCK;
+   if (c->current_b != -1) {
+      block_push(c->current_b, bl_full);
+      c->current_b = -1;
+   }
+   long b = block_pop(&tr->partial_b);
+   while (b == -1 && tr->unswept_b != -1) {
+      sweep_block(tr->unswept_b);
+      b = block_pop(&tr->partial_b);
+   }
+   if (b == -1) {
+      b = block_pop(&free_b);
+      while (b == -1 && num_unswept > 0) {
+         sweep_some(1);
+         b = block_pop(&free_b);
+      }
+      if (b == -1 && (released_b != -1 || fresh_blocks(1))) {
+         b = block_pop(&released_b);
+         num_released--;
+      }
+      if (b == -1) {
+         /* no free hunk found */
+         heap_exhausted = true;
+         UNLOCK;
+         return false;
+      }
+      assert(blockrecs[b].t == mt_undefined);
+      assert(blockrecs[b].in_use == 0);
+      blockrecs[b].t = t;
+      VALGRIND_CREATE_BLOCK(heap + b*BLOCKSIZE, BLOCKSIZE, types[t].name);
+      tr->nblocks++;
+      num_alloc_blocks++;
+      num_free_blocks--;
+   }
+   assert(blockrecs[b].t == t);
+   blockrecs[b].list = bl_current;
+   UNLOCK;
+
+   c->current_b = b;
+   a = b*BLOCKSIZE;
+   c->current_amax = a + AMAX(s);
+   goto search_in_block;
+}
+
+/* allocate from small-object heap if possible */
+STATICFUNC void *alloc_fixed_size(mt_t t)
+{
+   if (collect_in_progress && !collecting_child && !incr_marking && !conc_marking)
+      return NULL;
+
+   if (t >= _cmm_num_cursors)
+      grow_cursors();
+
+   cursor_t *c = &cursors[t];
+   if (c->a >= c->end) {
+      /* runs are accounted for when handed out, so this */
+      /* is the only place where a collect may trigger   */
+      cmm_safepoint();
+      maybe_trigger_collect(0);
+      if (heap_exhausted || !refill_cursor(t))
+         return NULL;
+   }
+
+   void *p = c->a;
+   c->a += c->size;
+   VALGRIND_MEMPOOL_ALLOC(heap, p, c->size);
+   return p;
+}
+
+/*
+ * Spans
+ *
+ * Variable-sized objects up to SPAN_MAX bytes are kept in the
+ * heap, in slots of one of the geometric size classes below. Each
+ * class is an internal type, starting at mt_span0, whose blocks
+ * are handed out like those of fixed-size types. Classes above
+ * BLOCKSIZE take runs of contiguous blocks (spans) with one slot
+ * each. The info_t of an object is kept at the end of its slot, so
+ * the object starts at the slot like any other heap object.
+ */
+
+static const size_t span_sizes[] = {
+   32, 48, 64, 96, 128, 192, 256, 384, 512, 680, 816, 1024, 1360,
+   2048, 4096, 8192, 12288, 16384, 24576, 32768, 49152, 65536
+};
+
+#define NUM_SPANS   ((int)(sizeof(span_sizes)/sizeof(span_sizes[0])))
+#define SPAN_MAX    65536
+#define mt_span0    (mt_refs + 1)
+
+/* first run of n free blocks in [b0, b1), or -1, a word of */
+/* free_map at a time                                         */
+STATICFUNC long find_free_run(long n, long b0, long b1)
+{
+   long run = 0;                /* free blocks ending the last word */
+   for (long i = b0/FREE_EPW; i*FREE_EPW < b1; i++) {
+      long base = i*FREE_EPW;
+      unsigned long w = free_map[i];
+      if (base < b0)
+         w &= ~0UL << (b0 - base);
+      if (base + FREE_EPW > b1)
+         w &= ~0UL >> (base + FREE_EPW - b1);
+      if (w == ~0UL) {
+         run += FREE_EPW;
+         if (run >= n)
+            return base + FREE_EPW - run;
+         continue;
+      }
+      if (run + __builtin_ctzl(~w) >= n)
+         return base - run;
+      /* m: bits starting n set bits in the word */
+      unsigned long m = n <= FREE_EPW ? w : 0;
+      for (long k = 1; k < n && m; k++)
+         m &= w >> k;
+      if (m)
+         return base + __builtin_ctzl(m);
+      run = __builtin_clzl(~w);
+   }
+   return -1;
+}
+
+/* n free blocks in a row, from where we left off, cmm_lock held */
+STATICFUNC long find_span(long n)
+{
+   long b = find_free_run(n, span_hint, heap_top);
+   if (b == -1)
+      b = find_free_run(n, 0, min(span_hint + n - 1, heap_top));
+   return b;
+}
+
+/* take a span of contiguous free blocks for span type t */
+STATICFUNC void *alloc_blocks(mt_t t)
+{
+   if (collect_in_progress && !collecting_child && !incr_marking && !conc_marking)
+      return NULL;
+   cmm_safepoint();
+   maybe_trigger_collect(0);
+
+   long n = types[t].size/BLOCKSIZE;
+   LOCK;
+   long b = find_span(n);
+   /* free blocks may still be waiting to be swept, */
+   /* else take fresh ones                          */
+   if (b == -1 && num_unswept) {
+      finish_sweep();
+      b = find_span(n);
+   }
+   if (b == -1 && fresh_blocks(n))
+      b = heap_top - n;
+   if (b == -1) {
+      UNLOCK;
+      return NULL;
+   }
+
+   for (long i = b; i < b + n; i++) {
+      block_unlink(i);
+      blockrecs[i].t = t;
+      blockrecs[i].list = bl_span;
+   }
+   blockrecs[b].in_use = 1;
+   blockrecs[b].young = 1;
+   block_push(b, bl_full);
+   types[t].nblocks += n;
+   num_alloc_blocks += n;
+   num_free_blocks -= n;
+   span_hint = (b + n) % heap_top;
+   UNLOCK;
+
+   uintptr_t a = b*BLOCKSIZE;
+   hmap_set_live(a, a + MIN_HUNKSIZE, conc_marking);
+   __atomic_add_fetch(&num_allocs, 1, __ATOMIC_RELAXED);
+   __atomic_add_fetch(&vol_allocs, types[t].size, __ATOMIC_RELAXED);
+   VALGRIND_CREATE_BLOCK(heap + a, types[t].size, types[t].name);
+   VALGRIND_MEMPOOL_ALLOC(heap, heap + a, types[t].size);
+   return heap + a;
+}
+
+/* allocate an object of type t and size s in a span slot */
+STATICFUNC void *alloc_span(mt_t t, size_t s)
+{
+   int c = 0;
+   while (span_sizes[c] < s + MIN_HUNKSIZE)
+      c++;
+   mt_t ts = mt_span0 + c;
+   void *p = types[ts].size > (size_t)BLOCKSIZE ? alloc_blocks(ts) : alloc_fixed_size(ts);
+   if (p) {
+      info_t *info = SPAN_INFO(p, ts);
+      info->t = t;
+      info->flags = 0;
+      info->nh = s/MIN_HUNKSIZE;
+   }
+   return p;
+}
+
+
+/*
+ * Large objects: objects of los_threshold bytes or more get a
+ * mapping of their own, with the info in front. They are managed
+ * like malloc'ed objects but unmapped when reclaimed, so their
+ * memory goes straight back to the system.
+ */
+
+#define LOS_MAPSIZE(nh)  ((((size_t)(nh)+1)*MIN_HUNKSIZE + PAGESIZE-1) & ~(size_t)(PAGESIZE-1))
+
+STATICFUNC void *alloc_large(mt_t t, size_t s)
+{
+   size_t n = LOS_MAPSIZE(s/MIN_HUNKSIZE);
+   void *p = mmap(NULL, n, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+   if (p == MAP_FAILED)
+      return NULL;
+
+   info_t *info = (info_t*)p;
+   info->t = t;
+   info->flags = INFO_LARGE;
+   info->nh = s/MIN_HUNKSIZE;
+   __atomic_add_fetch(&los_size, n, __ATOMIC_RELAXED);
+   __atomic_add_fetch(&los_count, 1, __ATOMIC_RELAXED);
+
+   maybe_trigger_collect(s);
+   return seal(p);
+}
+
+/* release the memory of an off-heap object, q as in managed[] */
+STATICFUNC void free_offheap(C99_CONST void *q)
+{
+   if (BLOB(q)) {
+      free(CLRPTR(q));
+      return;
+   }
+   info_t *info = (info_t*)unseal(q);
+   if (info->flags & INFO_LARGE) {
+      size_t n = LOS_MAPSIZE(info->nh);
+      __atomic_sub_fetch(&los_size, n, __ATOMIC_RELAXED);
+      __atomic_sub_fetch(&los_count, 1, __ATOMIC_RELAXED);
+      munmap(info, n);
+   } else {
+      __atomic_add_fetch(&offheap_freed, (info->nh + 1)*MIN_HUNKSIZE, __ATOMIC_RELAXED);
+      free(info);
+   }
+}
+
+/* allocate in the heap if possible, else with malloc */
+STATICFUNC void *alloc_variable_sized(mt_t t, size_t s)
+{
+   info_t *info = (info_t*)0;
+
+   /* make sure s is a multiple of MIN_HUNKSIZE */
+   assert(s%MIN_HUNKSIZE == 0);
+
+
+   if (s > CMM_SIZE_MAX) {
+      warn("size exceeds CMM_SIZE_MAX\n");
+      abort();
+   }
+  
+   void *p = NULL;
+   /* don't allocate from heap when t==mt_stack */
+   if (t && types[t].size>=s && (size_t)BLOCKSIZE>=s)
+      if ((p = alloc_fixed_size(t)))
+         return p;
+   if (t && s + MIN_HUNKSIZE <= SPAN_MAX && s < los_threshold)
+      if ((p = alloc_span(t, s)))
+         return p;
+   
+   cmm_safepoint();
+   if (s >= los_threshold)
+      if ((p = alloc_large(t, s)))
+         return p;
+malloc:
+   p = malloc(s + MIN_HUNKSIZE);  // + space for info
+
+   if (!p && collecting_child) {
+      if (gc_disabled)
+         warn("low memory and GC disabled\n");
+      else /* try to recover */
+         while (collecting_child)
+            fetch_unreachables(true);
+      goto malloc; 
+   }
+   if (!p)
+      return NULL;
+
+   assert(!LBITS(p));
+
+   info = (info_t*)p;
+   info->t = t;
+   info->flags = 0;
+   info->nh = s/MIN_HUNKSIZE;
+   p = seal(p);
+
+   maybe_trigger_collect(s);
+   return p;
+}
+
+// printf("address 0x%"PRIxPTR" (in block %d) is marked live\n", PPTR(heap + a), b);
+//    translates to
+// printf("address 0x%""l" "x"" (in block %d) is marked live\n", ((uintptr_t)(heap + a)), b);
+
+STATICFUNC bool no_marked_live(void)
+{
+   uintptr_t v[SELECT_MAX];
+   for (long b = 0; b < heap_top; b++) {
+      uintptr_t o = 0;
+      if (blockrecs[b].in_use > 0 && block_select(b, sel_live, live_flip, v, &o)) {
+         warn("address 0x%lx (in block %ld) is marked live\n", PPTR(heap + v[0]), b);
+         return false;
+      }
+   }
+
+   for (long i = 0; i <= man_last; i++) {
+      if (LIVE(managed[i])) {
+         void *p = CLRPTR(managed[i]);
+         warn("address 0x%lx is marked live\n", PPTR(p));
+         return false;
+      }
+   }
+
+   return true;
+}
+
+
+/*
+ * Page map: a two-level radix tree over page numbers. Its leaves
+ * hold, for every 16-byte slot of a page, the managed[] index + 1
+ * of the off-heap object at that address, so lookups take O(1).
+ * malloc aligns to 16 bytes and info_t takes 8, so no two objects
+ * share a slot. Entries are dropped when objects are reclaimed and
+ * renumbered when managed[] is compacted.
+ */
+
+#if UINTPTR_MAX > 0xffffffffUL
+#  define PM_ADDR_BITS  48
+#else
+#  define PM_ADDR_BITS  32
+#endif
+#define PM_SLOT_BITS    4
+#define PM_LEAF_SIZE    (1<<(PAGEBITS - PM_SLOT_BITS))
+#define PM_MID_BITS     ((PM_ADDR_BITS - PAGEBITS)/2)
+#define PM_ROOT_BITS    (PM_ADDR_BITS - PAGEBITS - PM_MID_BITS)
+#define PM_SLOT(p)      ((((uintptr_t)(p)) & (PAGESIZE-1)) >> PM_SLOT_BITS)
+
+/* leaf for the page of p, made if create */
+STATICFUNC long *pm_leaf(C99_CONST void *p, bool create)
+{
+   uintptr_t pg = ((uintptr_t)p) >> PAGEBITS;
+   if (pg >> (PM_ROOT_BITS + PM_MID_BITS)) {
+      if (!create)
+         return NULL;
+      warn("address 0x%lx out of page map range\n", PPTR(p));
+      abort();
+   }
+
+   long ***mid = &pagemap[pg >> PM_MID_BITS];
+   if (!*mid) {
+      if (!create)
+         return NULL;
+      *mid = (long **)calloc(1<<PM_MID_BITS, sizeof(long *));
+      ABORT_WHEN_OOM(*mid);
+      pm_size += (1<<PM_MID_BITS)*sizeof(long *);
+   }
+   long **leaf = &(*mid)[pg & ((1<<PM_MID_BITS)-1)];
+   if (!*leaf) {
+      if (!create)
+         return NULL;
+      *leaf = (long *)calloc(PM_LEAF_SIZE, sizeof(long));
+      ABORT_WHEN_OOM(*leaf);
+      pm_size += PM_LEAF_SIZE*sizeof(long);
+   }
+   return *leaf;
+}
+
+/* enter managed[i] into the page map, i == -1 removes p */
+STATICFUNC void pm_set(C99_CONST void *p, long i)
+{
+   long *leaf = pm_leaf(p, i != -1);
+   if (leaf)
+      leaf[PM_SLOT(p)] = i + 1;
+}
+
+STATICFUNC void pm_free(void)
+{
+   for (int r = 0; r < (1<<PM_ROOT_BITS); r++) {
+      if (!pagemap[r])
+         continue;
+      for (int m = 0; m < (1<<PM_MID_BITS); m++)
+         free(pagemap[r][m]);
+      free(pagemap[r]);
+   }
+   free(pagemap);
+}
+
+/* Remove obsolete entries from managed. */
+STATICFUNC void compact_managed(void)
+{
+   assert(!collect_in_progress);
+
+   if (man_is_compact) return;
+
+   long n = 0;
+   for (long i = 0; i <= man_last; i++) {
+      if (OBSOLETE(managed[i]))
+         continue;
+      if (n != i) {
+         managed[n] = managed[i];
+         man_dirty[n] = man_dirty[i];
+         pm_set(CLRPTR(managed[n]), n);
+      }
+      n++;
+   }
+   man_last = n-1;
+   
+   /* shrink when much bigger than necessary */
+   if (man_last*4<man_size && man_size > MIN_MANAGED) {
+      man_size /= 2;
+      debug("shrinking managed table to %ld\n", man_size);
+      managed = (void **)realloc(managed, man_size*sizeof(void *));
+      assert(managed);
+      man_dirty = (unsigned char *)realloc(man_dirty, man_size);
+      assert(man_dirty);
+   }
+   man_is_compact = true;
+}
+
+STATICFUNC long _find_managed(C99_CONST void *p)
+{
+   long *leaf = pm_leaf(p, false);
+   if (!leaf)
+      return -1;
+   long i = leaf[PM_SLOT(p)] - 1;
+   return (i >= 0 && CLRPTR(managed[i]) == p) ? i : -1;
 }
 
 /* use this one only when not marking */
-STATICFUNC int find_managed(C99_CONST void *p)
+STATICFUNC long find_managed(C99_CONST void *p)
 {
    assert(!mark_in_progress);
-   int i = _find_managed(p);
-   if (i>-1 && OBSOLETE(managed[i]))
+   long i = _find_managed(p);
+   /* while marking in slices or concurrently, the bit is a mark; */
+   /* entries go obsolete in sweeps only and are compacted before */
+   if (i>-1 && OBSOLETE(managed[i]) && !incr_marking && !conc_marking)
       i = -1;
    return i;
 }
@@ -807,15 +1934,23 @@ STATICFUNC int find_managed(C99_CONST void *p)
  */
 STATICFUNC void add_managed(C99_CONST void *p)
 {
+   LOCK;
    man_last++;
    if (man_last == man_size) {
       man_size *= 2;
-      debug("enlarging managed table to %d\n", man_size);
+      debug("enlarging managed table to %ld\n", man_size);
       managed = (void **)realloc(managed, man_size*sizeof(void *));
       ABORT_WHEN_OOM(managed);
+      man_dirty = (unsigned char *)realloc(man_dirty, man_size);
+      ABORT_WHEN_OOM(man_dirty);
    }
    assert(man_last < man_size);
    managed[man_last] = (void *)p;
+   man_dirty[man_last] = 0;
+   if (conc_marking)
+      MARK_LIVE(managed[man_last]);   /* allocate black */
+   pm_set(p, man_last);
+   UNLOCK;
 }
 
 STATICFUNC void manage(C99_CONST void *p, mt_t t)
@@ -832,7 +1967,7 @@ STATICFUNC void manage(C99_CONST void *p, mt_t t)
    stack_push(_cmm_transients, p);
 
    if (profile)
-      profile[t]++;
+      __atomic_add_fetch(&profile[t], 1, __ATOMIC_RELAXED);
 }
 
 STATICFUNC void collect_prologue(void)
@@ -840,86 +1975,400 @@ STATICFUNC void collect_prologue(void)
    assert(!collect_in_progress);
    assert(!collecting_child);
    assert(!stack_overflowed2);
-   if (cmm_debug_enabled)
+
+   /* unused parts of runs must not count as in use */
+   retire_cursors();
+   finish_sweep();
+   if (cmm_debug_enabled && gc_mode != cmm_mode_generational)
       assert(no_marked_live());
    
-   /* prepare managed array and poplar data */
-   update_man_k();
-   for (int n = 0; n < man_t; n++)
-      sort_poplar(n);
-   assert(man_k == man_last);
+   /* entries added from here on are not swept */
+   man_k = man_last;
 
    collect_in_progress = true;
    if (cmm_debug_enabled) {
       check_num_free_blocks();
       debug("%dth collect after %d allocations:\n",
             num_collects, num_allocs);
-      debug("mean alloc %.2f bytes, %d free blocks, down %d blocks)\n",
+      debug("mean alloc %.2f bytes, %ld free blocks, down %ld blocks)\n",
             (num_allocs ? ((double)vol_allocs)/num_allocs : 0),
             num_free_blocks, num_alloc_blocks);
    }
 }
 
-STATICFUNC void collect_epilogue(void)
+STATICFUNC void collect_epilogue(void)
+{
+   assert(collect_in_progress);
+
+   if (stack_overflowed2 && stack_size < MAX_MARK_STACK) {
+      /* only effective with synchronous collect */
+      stack_size *= 2;
+      debug("enlarging marking stack to %d\n", stack_size);
+      stack_overflowed2 = false;
+   }
+
+   marking_type = mt_undefined;
+   marking_object = NULL;
+   collect_requested = false;
+
+   heap_exhausted = false;
+   collect_in_progress = false;
+   /* a snapshot collect marks the child's copy only, */
+   /* survivors of a generational one stay marked     */
+   if (!collecting_child && gc_mode != cmm_mode_generational)
+      live_flip = ~live_flip;   /* survivors are unmarked now */
+   collecting_child = 0;
+   num_alloc_blocks = 0;
+   num_collects += 1;
+   num_allocs = 0;
+   vol_allocs = 0;
+   fetch_backlog = 0;
+   compact_managed();
+   if (gc_mode == cmm_mode_generational) {
+      for (long b = 0; b < heap_top; b++)
+         blockrecs[b].young = 0;
+      if (!minor_collect) {
+         old_limit = live_bytes + max(live_bytes/100*OLD_GROWTH, (size_t)PACE_MIN);
+         old_man_limit = man_last + 1 + max((man_last + 1)/100*OLD_GROWTH, 1024);
+         num_majors++;
+      }
+      minor_collect = false;
+   }
+   set_thresholds();
+   debug("%ld bytes live, next collect after %ld bytes\n",
+         (long)live_bytes, (long)volume_threshold);
+}
+
+/*
+ * Parallel marking
+ *
+ * With more than one marker configured (cmm_mark_threads), the
+ * roots are dealt out to the mark deques of the collecting thread
+ * and a pool of marker threads. Each marker pops from the bottom
+ * of its own deque and steals from the top of the others' when
+ * it runs dry (Chase & Lev, SPAA 2005). Live bits are set with
+ * atomic operations, so an object is traced by one marker only.
+ * A full deque is handled like an overflowing marking stack.
+ * The same threads sweep in parallel, see sweep_parallel.
+ */
+
+#define MAX_MARKERS     64
+#define STEAL_ATTEMPTS  4
+
+typedef struct marker {
+   long            top;          /* thieves take from here */
+   long            bottom;       /* owner pushes and pops here */
+   C99_CONST void **buf;
+   long            mask;         /* capacity - 1 */
+   bool            overflowed;
+   int             id;
+   unsigned int    seed;
+   mt_t            cur_type;     /* object being traced */
+   C99_CONST void *cur_object;
+   int             swept;        /* results of sweep_part */
+   long            *touched;     /* blocks with objects freed */
+   int             num_touched;
+   void            **deferred;   /* in-heap objects to reclaim later */
+   int             num_deferred;
+   long            *deferred_i;  /* managed[] entries to reclaim later */
+   long            num_deferred_i;
+   int             size_touched, size_deferred;
+   long            size_deferred_i;
+   bool            obsoleted;
+   bool            grows;        /* has no thieves, see deque_grow */
+} marker_t;
+
+static int        num_markers = 1;          /* configured */
+static marker_t   markers[MAX_MARKERS];     /* [0] is the collector */
+static int        pool_size = 1;            /* marker threads + 1 */
+static int        pool_active;              /* markers in this round */
+static int        pool_busy;
+static int        pool_round = 0;
+static int        pool_idle;
+static cmm_heap_t *pool_heap;
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  pool_go   = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t  pool_done = PTHREAD_COND_INITIALIZER;
+static void      (*pool_job)(marker_t *);
+static CMM_TLS marker_t *marker = NULL;     /* set while marking in parallel */
+
+/* double the buffer of a deque nobody steals from */
+STATICFUNC bool deque_grow(marker_t *mk)
+{
+   long mask = 2*mk->mask + 1;
+   C99_CONST void **buf = (C99_CONST void **)malloc((mask + 1)*sizeof(void *));
+   if (!buf)
+      return false;
+   for (long i = mk->top; i < mk->bottom; i++)
+      buf[i & mask] = mk->buf[i & mk->mask];
+   free(mk->buf);
+   mk->buf = buf;
+   mk->mask = mask;
+   return true;
+}
+
+STATICFUNC void deque_push(marker_t *mk, C99_CONST void *p)
+{
+   long b = __atomic_load_n(&mk->bottom, __ATOMIC_RELAXED);
+   long t = __atomic_load_n(&mk->top, __ATOMIC_ACQUIRE);
+   if (b - t > mk->mask && !(mk->grows && deque_grow(mk))) {
+      mk->overflowed = true;
+      return;
+   }
+   mk->buf[b & mk->mask] = p;
+   __atomic_store_n(&mk->bottom, b + 1, __ATOMIC_RELEASE);
+}
+
+STATICFUNC C99_CONST void *deque_pop(marker_t *mk)
+{
+   long b = __atomic_load_n(&mk->bottom, __ATOMIC_RELAXED) - 1;
+   __atomic_store_n(&mk->bottom, b, __ATOMIC_RELAXED);
+   __atomic_thread_fence(__ATOMIC_SEQ_CST);
+   long t = __atomic_load_n(&mk->top, __ATOMIC_RELAXED);
+
+   if (t > b) {
+      __atomic_store_n(&mk->bottom, b + 1, __ATOMIC_RELAXED);
+      return NULL;
+   }
+   C99_CONST void *p = mk->buf[b & mk->mask];
+   if (t == b) {
+      /* last element, race against thieves */
+      if (!__atomic_compare_exchange_n(&mk->top, &t, t + 1, false,
+                                       __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+         p = NULL;
+      __atomic_store_n(&mk->bottom, b + 1, __ATOMIC_RELAXED);
+   }
+   return p;
+}
+
+STATICFUNC C99_CONST void *deque_steal(marker_t *mk)
+{
+   long t = __atomic_load_n(&mk->top, __ATOMIC_ACQUIRE);
+   __atomic_thread_fence(__ATOMIC_SEQ_CST);
+   long b = __atomic_load_n(&mk->bottom, __ATOMIC_ACQUIRE);
+
+   if (t >= b)
+      return NULL;
+   C99_CONST void *p = mk->buf[t & mk->mask];
+   if (!__atomic_compare_exchange_n(&mk->top, &t, t + 1, false,
+                                    __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+      return NULL;
+   return p;
+}
+
+STATICFUNC bool deque_empty(marker_t *mk)
+{
+   return __atomic_load_n(&mk->top, __ATOMIC_ACQUIRE) >=
+      __atomic_load_n(&mk->bottom, __ATOMIC_ACQUIRE);
+}
+
+/* set live bit of p, return false when it was set already */
+STATICFUNC bool try_mark_live(C99_CONST void *p)
+{
+   ptrdiff_t a = ((char *)p) - heap;
+   if (a>=0 && (unsigned long)a<heapsize) {
+      assert(HMAP_MANAGED(a));
+      unsigned int bit = HMAP_BIT(a);
+      unsigned int old = live_flip
+         ? __atomic_fetch_and(&HMAP_WORD(a, lbits), ~bit, __ATOMIC_RELAXED)
+         : __atomic_fetch_or(&HMAP_WORD(a, lbits), bit, __ATOMIC_RELAXED);
+      return !((old ^ live_flip) & bit);
+   }
+   /* the concurrent marker runs while managed may grow */
+   if (!mark_in_progress) LOCK;
+   long i = _find_managed(p);
+   assert(i != -1);
+   bool fresh = !LIVE(__atomic_fetch_or((uintptr_t *)&managed[i], BITL,
+                                        __ATOMIC_RELAXED));
+   if (!mark_in_progress) UNLOCK;
+   return fresh;
+}
+
+STATICFUNC C99_CONST void *steal_work(marker_t *mk)
+{
+   for (int k = 0; k < STEAL_ATTEMPTS*pool_active; k++) {
+      int v = rand_r(&mk->seed) % pool_active;
+      if (v != mk->id) {
+         C99_CONST void *p = deque_steal(&markers[v]);
+         if (p)
+            return p;
+      }
+   }
+   return NULL;
+}
+
+/* trace until all deques are empty and all markers idle */
+STATICFUNC void drain(marker_t *mk)
 {
-   assert(collect_in_progress);
+   for (;;) {
+      C99_CONST void *p;
+      while ((p = deque_pop(mk)) || (p = steal_work(mk))) {
+         mk->cur_object = p;
+         mt_t t = mk->cur_type = cmm_typeof(p);
+         if (types[t].mark)
+            types[t].mark(p);
+      }
 
-   if (stack_overflowed2) {
-      /* only effective with synchronous collect */
-      stack_size *= 2;
-      debug("enlarging marking stack to %d\n", stack_size);
-      stack_overflowed2 = false;
+      /* out of work, wait for more to show up or for the end */
+      __atomic_add_fetch(&pool_idle, 1, __ATOMIC_SEQ_CST);
+      for (;;) {
+         if (__atomic_load_n(&pool_idle, __ATOMIC_SEQ_CST) == pool_active)
+            return;
+         bool found = false;
+         for (int v = 0; v < pool_active && !found; v++)
+            found = !deque_empty(&markers[v]);
+         if (found) {
+            __atomic_sub_fetch(&pool_idle, 1, __ATOMIC_SEQ_CST);
+            break;
+         }
+         sched_yield();
+      }
    }
+}
 
-   marking_type = mt_undefined;
-   marking_object = NULL;
-   collect_requested = false;
+STATICFUNC void *marker_main(void *arg)
+{
+   marker_t *mk = (marker_t *)arg;
+   int round = 0;
+
+   pthread_mutex_lock(&pool_lock);
+   for (;;) {
+      while (pool_round == round)
+         pthread_cond_wait(&pool_go, &pool_lock);
+      round = pool_round;
+      if (mk->id >= pool_active)
+         continue;
+      pthread_mutex_unlock(&pool_lock);
+
+      cur_heap = pool_heap;
+      pool_job(mk);
+      cur_heap = NULL;
+
+      pthread_mutex_lock(&pool_lock);
+      if (--pool_busy == 0)
+         pthread_cond_signal(&pool_done);
+   }
+   return NULL;
+}
 
-#ifdef CMM_SNAPSHOT_GC
-   if (collecting_child) {
-      int status; 
-      if (waitpid(collecting_child, &status, 0) == -1) {
-         char *errmsg = strerror(errno);
-         warn("waiting for collecting child failed:\n%s\n", errmsg);
+/* start marker threads until there are n markers */
+STATICFUNC void start_markers(int n)
+{
+   for (int i = 0; i < n; i++)
+      markers[i].id = i;
+
+   while (pool_size < n) {
+      pthread_t tid;
+      pthread_attr_t attr;
+      pthread_attr_init(&attr);
+      pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+      if (pthread_create(&tid, &attr, marker_main, &markers[pool_size])) {
+         warn("could not start marker thread\n");
          abort();
       }
-      if (!WIFEXITED(status)) {
-         warn("collecting child terminated abnormally:\n");
-         if (WIFSIGNALED(status))
-            warn("terminated by signal %d\n", WTERMSIG(status));
-         else if (WIFSTOPPED(status))
-            warn("stopped by signal %d\n", WSTOPSIG(status));
-#  ifdef WCOREDUMP
-         else if (WCOREDUMP(status))
-            warn("coredumped\n");
-#  endif
-         else
-            warn("cause unknown (status = %d)\n", status);
-         abort();
+      pthread_attr_destroy(&attr);
+      pool_size++;
+   }
+}
+
+/* run job on n markers, the calling thread being the first */
+STATICFUNC void run_markers(int n, void (*job)(marker_t *))
+{
+   start_markers(n);
+
+   pthread_mutex_lock(&pool_lock);
+   pool_job = job;
+   pool_heap = cur_heap;
+   pool_active = n;
+   pool_busy = n - 1;
+   pool_idle = 0;
+   pool_round++;
+   pthread_cond_broadcast(&pool_go);
+   pthread_mutex_unlock(&pool_lock);
+
+   job(&markers[0]);
+
+   pthread_mutex_lock(&pool_lock);
+   while (pool_busy > 0)
+      pthread_cond_wait(&pool_done, &pool_lock);
+   pthread_mutex_unlock(&pool_lock);
+}
+
+STATICFUNC void mark_part(marker_t *mk)
+{
+   marker = mk;
+   drain(mk);
+   marker = NULL;
+}
+
+/* trace from the roots with n markers */
+STATICFUNC void mark_parallel(int n)
+{
+   assert((stack_size & (stack_size - 1)) == 0);
+
+   /* empty deques of stack_size entries */
+   for (int i = 0; i < n; i++) {
+      marker_t *mk = &markers[i];
+      if (mk->mask + 1 < stack_size) {
+         free(mk->buf);
+         mk->buf = (C99_CONST void **)malloc(stack_size*sizeof(void *));
+         ABORT_WHEN_OOM(mk->buf);
+         mk->mask = stack_size - 1;
       }
-      //cmm_printf("reaped gc child %d\n", collecting_child);
-      collecting_child = 0;
+      mk->top = mk->bottom = 0;
+      mk->overflowed = false;
+      mk->seed = i + 1;
+      mk->cur_type = mt_undefined;
+      mk->cur_object = NULL;
    }
-#endif
-   heap_exhausted = false;
-   collect_in_progress = false;
-   num_alloc_blocks = 0;
-   num_collects += 1;
-   num_allocs = 0;
-   vol_allocs = 0;
-   fetch_backlog = 0;
-   compact_managed();
+
+   /* deal out the roots */
+   for (int r = 0; r <= roots_last; r++) {
+      C99_CONST void *p = *roots[r];
+      if (p) {
+         if (!cmm_ismanaged(p)) {
+            warn("root at 0x%" "lx" " is not a managed address\n",
+                 PPTR(roots[r]));
+            abort();
+         }
+         if (try_mark_live(p))
+            deque_push(&markers[r % n], p);
+      }
+   }
+
+   run_markers(n, mark_part);
+
+   /* objects dropped from full deques are live but not traced */
+   for (int i = 0; i < n; i++)
+      if (markers[i].overflowed)
+         stack_overflowed = true;
+}
+
+int cmm_mark_threads(int n)
+{
+   int prev = num_markers;
+   if (n > 0)
+      num_markers = min(n, MAX_MARKERS);
+   return prev;
 }
 
 /*
  * Push address onto marking stack and mark it if requested.
  */
 
-STATICFUNC void __cmm_push(C99_CONST void *p)
+STATICFUNC void push_grey(C99_CONST void *p)
 {
-   mark_live(p);
-   
    stack_last++;
+   if (stack_last == stack_size && incr_marking && stack_size < MAX_MARK_STACK) {
+      /* the stack of an incremental collect is malloc'ed, */
+      /* recovering would scan the heap in a single slice   */
+      C99_CONST void **s = (C99_CONST void **)
+         realloc(stack, 2*stack_size*sizeof(void *));
+      if (s) {
+         stack = s;
+         stack_size *= 2;
+      }
+   }
    if (stack_last == stack_size) {
       stack_overflowed = true;
       stack_last--;
@@ -928,9 +2377,18 @@ STATICFUNC void __cmm_push(C99_CONST void *p)
    }
 }
 
+STATICFUNC void __cmm_push(C99_CONST void *p)
+{
+   mark_live(p);
+   push_grey(p);
+}
+
 void _cmm_push(C99_CONST void *p)
 {
-   if (live(p))
+   if (marker) {
+      if (try_mark_live(p))
+         deque_push(marker, p);
+   } else if (live(p))
       return;
    else
       __cmm_push(p);
@@ -948,6 +2406,7 @@ STATICFUNC bool empty(void)
 
 STATICFUNC void recover_stack(void)
 {
+   d();
    if (!stack_overflowed) return;
    debug("marking stack overflowed, recovering\n");
    assert(empty());
@@ -955,32 +2414,50 @@ STATICFUNC void recover_stack(void)
    stack_overflowed2 = true;
 
    /* mark children of all live objects */
-   DO_HEAP(a, b) {
-      if (HMAP_LIVE(a)) {
-         mark_func_t *mark = types[blockrecs[b].t].mark;
-         if (mark)
-            mark(heap + a);
-      }
-   } DO_HEAP_END;
+   uintptr_t v[SELECT_MAX];
+   for (long b = 0; b < heap_top; b++) {
+      typerec_t *tr = &types[blockrecs[b].t];
+      if (blockrecs[b].in_use == 0 || !(tr->mark || tr->span))
+         continue;
+      int k;
+      for (uintptr_t o = 0; (k = block_select(b, sel_live, live_flip, v, &o)); )
+         for (int j = 0; j < k; j++) {
+            mark_func_t *mark = types[heap_type(v[j])].mark;
+            if (mark)
+               mark(heap + v[j]);
+         }
+   }
       
-   DO_MANAGED(i) {
-      if (LIVE(managed[i])) {
-         mt_t t  = INFO_T(managed[i]);
-         if (types[t].mark)
-            types[t].mark(CLRPTR(managed[i]));
+//   DO_MANAGED(i) {
+   { 
+      long __lasti = collect_in_progress ? man_k : man_last; 
+      for (long i = 0; i <= __lasti; i++) {
+	 {
+
+	    if (LIVE(managed[i])) {
+	       mt_t t  = INFO_T(managed[i]);
+	       if (types[t].mark)
+		  types[t].mark(CLRPTR(managed[i]));
+	    }
+	 } 
+	 
+
       }
-   } DO_MANAGED_END;
+   }
+   // DO_MANAGED_END;
 }
 
 void _cmm_check_managed(C99_CONST void *p)
 {
    if (!cmm_ismanaged(p)) {
-      const char *name = (marking_type == mt_undefined) ?
-         "undefined" : types[marking_type].name;
+      mt_t mt = marker ? marker->cur_type : marking_type;
+      C99_CONST void *mo = marker ? marker->cur_object : marking_object;
+      const char *name = (mt == mt_undefined) ?
+         "undefined" : types[mt].name;
       warn("attempt to mark non-managed address\n");
-      if (marking_object)
+      if (mo)
          warn(" 0x%lx (%s) -> 0x%lx\n", 
-              PPTR(marking_object), name, PPTR(p));
+              PPTR(mo), name, PPTR(p));
       else
          warn(" 0x%lx\n", PPTR(p));
       abort();
@@ -1026,8 +2503,8 @@ STATICFUNC bool run_finalizer(finalize_func_t *f, void *q)
 
 STATICFUNC void reclaim_inheap(void *q)
 {
-   C99_CONST int b = BLOCK(q);
-   C99_CONST mt_t t = blockrecs[b].t;
+   C99_CONST long b = BLOCK(q);
+   C99_CONST mt_t t = heap_type((char *)q - heap);
    finalize_func_t *f = types[t].finalize;
    if (f)
       if (!run_finalizer(f, q))
@@ -1047,27 +2524,25 @@ STATICFUNC void reclaim_inheap(void *q)
    assert(blockrecs[b].in_use > 0);
    blockrecs[b].in_use--;      
    if (blockrecs[b].in_use == 0) {
-      blockrecs[b].t = mt_undefined;
-      num_free_blocks++;
+      free_block(b);
       VALGRIND_DISCARD((block_t *)BLOCK_ADDR(q));
+   } else if (blockrecs[b].list == bl_full) {
+      block_unlink(b);
+      block_push(b, bl_partial);
    }
-   if (b < types[t].next_b)
-      types[t].next_b = b;
 }
 
 
-STATICFUNC void reclaim_offheap(int i)
+STATICFUNC void reclaim_offheap(long i)
 {
    assert(!OBSOLETE(managed[i]));
 
    void *q = CLRPTR(managed[i]);
    if (!BLOB(managed[i])) {
-      info_t *info_q = (info_t*)unseal(q); 
-      finalize_func_t *f = types[info_q->t].finalize;
+      finalize_func_t *f = types[INFO_T(managed[i])].finalize;
       if (f)
          if (!run_finalizer(f, q))
             return;
-      q = info_q;
    }
 
    if (NOTIFY(managed[i])) {
@@ -1075,13 +2550,13 @@ STATICFUNC void reclaim_offheap(int i)
       client_notify(managed[i]);
    }
    
+   pm_set(q, -1);
+   free_offheap(managed[i]);
    MARK_OBSOLETE(managed[i]);
    man_is_compact = false;
-
-   free(q);
 }
 
-
+#if 0
 STATICFUNC int sweep_now(void)
 {
    int n = 0;
@@ -1109,6 +2584,175 @@ STATICFUNC int sweep_now(void)
    debug("%d objects reclaimed\n", n);
    return n;
 }
+#endif
+
+
+int sweep_now(void)
+{
+   int n = 0;
+
+   /* objects in small object heap */
+   uintptr_t v[SELECT_MAX];
+   for (long b = 0; b < heap_top; b++) {
+      if (blockrecs[b].in_use == 0 || blockrecs[b].list == bl_unswept ||
+          (minor_collect && !blockrecs[b].young))
+         continue;
+      int k;
+      for (uintptr_t o = 0; (k = block_select(b, sel_dead, live_flip, v, &o)); ) {
+         for (int j = 0; j < k; j++)
+            reclaim_inheap(heap + v[j]);
+         n += k;
+      }
+   }
+//
+//   /* malloc'ed objects */
+//   DO_MANAGED(i) {
+
+   { 
+      long __lasti = collect_in_progress ? man_k : man_last; for (long i = 0; i <= __lasti; i++) {
+	 {
+	    if ((((uintptr_t)(managed[i])) & 1)) {
+	       { managed[i] = (void *)((uintptr_t)(managed[i]) & ~1); };
+	    } else if (!minor_collect) {   /* see mark_remembered */
+	       reclaim_offheap(i);
+	       n++;
+	    }
+	 } 
+      }
+   };
+
+//    } DO_MANAGED_END;
+   
+   debug("%d objects reclaimed\n", n);
+   return n;
+}
+
+/*
+ * Parallel sweep: markers claim ranges of blocks and of
+ * managed[] and free what needs neither a finalizer nor a
+ * notification. Everything else, and all changes to the block
+ * lists, is left to the collecting thread afterwards, so
+ * finalizers and notify run there as before.
+ */
+
+#define SWEEP_BLOCKS    16      /* blocks claimed at once  */
+#define SWEEP_MANAGED   1024    /* entries claimed at once */
+
+#define APPEND(v, n, size, x) { \
+   if ((n) == (size)) { \
+      (size) = (size) ? 2*(size) : 256; \
+      (v) = (__typeof__(v))realloc((v), (size)*sizeof(*(v))); \
+      ABORT_WHEN_OOM(v); \
+   } \
+   (v)[(n)++] = (x); \
+}
+
+static long       sweep_next_b;
+static long       sweep_next_i;
+
+STATICFUNC void sweep_part(marker_t *mk)
+{
+   long b0;
+   long i0;
+
+   while ((b0 = __atomic_fetch_add(&sweep_next_b, SWEEP_BLOCKS,
+                                   __ATOMIC_RELAXED)) < heap_top) {
+      long b_end = min(b0 + SWEEP_BLOCKS, heap_top);
+      for (long b = b0; b < b_end; b++) {
+         if (blockrecs[b].in_use == 0 || blockrecs[b].list == bl_unswept ||
+             (minor_collect && !blockrecs[b].young))
+            continue;
+         typerec_t *tr = &types[blockrecs[b].t];
+         int in_use = blockrecs[b].in_use;
+         uintptr_t v[SELECT_MAX];
+         int k;
+         for (uintptr_t o = 0; (k = block_select(b, sel_dead, live_flip, v, &o)); )
+            for (int j = 0; j < k; j++) {
+               uintptr_t a = v[j];
+               finalize_func_t *f = tr->span ? types[heap_type(a)].finalize : tr->finalize;
+               if (f || HMAP_NOTIFY(a))
+                  APPEND(mk->deferred, mk->num_deferred, mk->size_deferred,
+                         heap + a)
+               else {
+                  HMAP_UNMARK_MANAGED(a);
+                  VALGRIND_MEMPOOL_FREE(heap, heap + a);
+                  blockrecs[b].in_use--;
+                  mk->swept++;
+               }
+            }
+         if (blockrecs[b].in_use != in_use)
+            APPEND(mk->touched, mk->num_touched, mk->size_touched, b);
+      }
+   }
+
+   long lasti = man_k;
+   while ((i0 = __atomic_fetch_add(&sweep_next_i, SWEEP_MANAGED,
+                                   __ATOMIC_RELAXED)) <= lasti) {
+      long i_end = min(i0 + SWEEP_MANAGED - 1, lasti);
+      for (long i = i0; i <= i_end; i++) {
+         if (LIVE(managed[i])) {
+            UNMARK_LIVE(managed[i]);
+            continue;
+         }
+         if (minor_collect)
+            continue;
+         bool blob = BLOB(managed[i]);
+         if (NOTIFY(managed[i]) || (!blob && types[INFO_T(managed[i])].finalize)) {
+            APPEND(mk->deferred_i, mk->num_deferred_i, mk->size_deferred_i, i);
+            continue;
+         }
+         pm_set(CLRPTR(managed[i]), -1);
+         free_offheap(managed[i]);
+         MARK_OBSOLETE(managed[i]);
+         mk->obsoleted = true;
+         mk->swept++;
+      }
+   }
+}
+
+STATICFUNC int sweep_parallel(int n)
+{
+   assert(collect_in_progress && man_k == man_last);
+
+   for (int i = 0; i < n; i++) {
+      marker_t *mk = &markers[i];
+      mk->swept = 0;
+      mk->num_touched = mk->num_deferred = mk->num_deferred_i = 0;
+      mk->obsoleted = false;
+   }
+   sweep_next_b = 0;
+   sweep_next_i = 0;
+   run_markers(n, sweep_part);
+
+   int swept = 0;
+   for (int i = 0; i < n; i++) {
+      marker_t *mk = &markers[i];
+      swept += mk->swept;
+      if (mk->obsoleted)
+         man_is_compact = false;
+      for (int k = 0; k < mk->num_touched; k++) {
+         long b = mk->touched[k];
+         if (blockrecs[b].in_use == 0) {
+            free_block(b);
+            VALGRIND_DISCARD((block_t *)(heap + b*BLOCKSIZE));
+         } else if (blockrecs[b].list == bl_full) {
+            block_unlink(b);
+            block_push(b, bl_partial);
+         }
+      }
+   }
+   for (int i = 0; i < n; i++) {
+      marker_t *mk = &markers[i];
+      for (int k = 0; k < mk->num_deferred; k++)
+         reclaim_inheap(mk->deferred[k]);
+      for (long k = 0; k < mk->num_deferred_i; k++)
+         reclaim_offheap(mk->deferred_i[k]);
+      swept += mk->num_deferred + mk->num_deferred_i;
+   }
+
+   debug("%d objects reclaimed\n", swept);
+   return swept;
+}
 
 
 /*
@@ -1116,14 +2760,14 @@ STATICFUNC int sweep_now(void)
  * list of chunks and is itself managed.
  */
 
-#define STACK_ELTS_PER_CHUNK  (BLOCKSIZE/sizeof(void *) - 1)
+#define STACK_ELTS_PER_CHUNK  (PAGESIZE/sizeof(void *) - 1)
 
 typedef struct stack_chunk {
    struct stack_chunk  *prev;
    stack_elem_t        elems[STACK_ELTS_PER_CHUNK];
 } stack_chunk_t;
 
-struct stack {
+struct cmm_stack {
    stack_ptr_t     sp;
    stack_ptr_t     sp_min;
    stack_ptr_t     sp_max;
@@ -1188,14 +2832,14 @@ STATICFUNC void add_chunk(cmmstack_t *st)
 
 void _cmm_pop_chunk(cmmstack_t *st)
 {
-   if (INHEAP(st->current)) {
-      /* reclaim stack chunks immediately */
-      int b = BLOCK(st->current);
+   if (INHEAP(st->current) && sizeof(stack_chunk_t) == (size_t)BLOCKSIZE) {
+      /* reclaim stack chunks immediately, when they fill */
+      /* their block, else the next collect does          */
+      long b = BLOCK(st->current);
       HMAP_UNMARK_MANAGED(b*BLOCKSIZE);
-      blockrecs[b].t = mt_undefined;
-      blockrecs[b].in_use = 0;
-      num_free_blocks++;
-      types[mt_stack_chunk].next_b = b;
+      LOCK;
+      free_block(b);
+      UNLOCK;
    }
    st->current = st->current->prev;
    if (!st->current) {
@@ -1209,17 +2853,17 @@ void _cmm_pop_chunk(cmmstack_t *st)
 
 static cmmstack_t *make_stack(void)
 {
-   DISABLE_GC;
+   DISABLE_GC;  // expands to: bool __nogc = gc_disabled; gc_disabled = true;
    
-   size_t s = MIN_HUNKSIZE*(1+(sizeof(cmmstack_t)/MIN_HUNKSIZE));
+   size_t s = MIN_HUNKSIZE*(1+(sizeof(cmmstack_t)/MIN_HUNKSIZE)); // expands to: (1<<3)*(1+(sizeof(cmmstack_t)/(1<<3)));
    cmmstack_t *st = (cmmstack_t*)alloc_variable_sized(mt_stack, s);
-   ABORT_WHEN_OOM(st);
-   assert(st && !INHEAP(st));
+   ABORT_WHEN_OOM(st);         // expands to:  if (!(st)) { warn("allocation failed\n"); abort(); }
+   assert(st && !INHEAP(st));  // expands to: (((char *)(st) >= heap) && ((char *)(st) < (heap + heapsize)))
    memset(st, 0, sizeof(cmmstack_t));
    add_managed(st);
    add_chunk(st);
 
-   ENABLE_GC;
+   ENABLE_GC; // expands to: gc_disabled = __nogc;
    return st;
 }
 
@@ -1399,13 +3043,150 @@ void cmm_anchor(C99_CONST void *p)
 void cmm_debug(bool e)
 {
    cmm_debug_enabled = e;
+   if (e && self && stack_empty(_cmm_transients))
+      assert(stack_works_fine(_cmm_transients));
+}
+
+
+/*
+ * Make h the heap of the calling thread, creating the thread's
+ * mutator for h on first use. The thread must be registered.
+ */
+STATICFUNC void use_heap(cmm_heap_t *h)
+{
+   mutator_t *m = self->muts;
+   while (m && m->h != h)
+      m = m->next_of_thread;
+
+   cur_heap = h;
+   self->current = h;
+   _cmm_heap = heap;
+   _cmm_hmap = hmap;
+   _cmm_block_bits = block_bits;
+   _cmm_cards = gc_mode == cmm_mode_generational ? cards : NULL;
+   _cmm_num_cards = max_blocks*CARDS_PER_BLOCK;
+
+   if (m) {
+      me = m;
+      cursors = m->curs;
+      _cmm_num_cursors = m->num_curs;
+      _cmm_transients = m->transients;
+      return;
+   }
+
+   m = (mutator_t *)calloc(1, sizeof(mutator_t));
+   ABORT_WHEN_OOM(m);
+   m->h = h;
+   m->th = self;
+   LOCK;
+   m->next = mutators;
+   mutators = m;
+   m->next_of_thread = self->muts;
+   self->muts = m;
+   UNLOCK;
+
+   me = m;
+   cursors = NULL;
+   _cmm_num_cursors = 0;
+   grow_cursors();
+   _cmm_transients = m->transients = make_stack();
+   CMM_ROOT(m->transients);
+}
+
+
+void cmm_thread_register(void)
+{
+   if (self) {
+      warn("thread is already registered\n");
+      return;
+   }
+   thread_t *th = (thread_t *)calloc(1, sizeof(thread_t));
+   ABORT_WHEN_OOM(th);
+
+   LOCK;
+   /* the world may be stopped, but not waiting for us */
+   while (_cmm_stop_requested)
+      pthread_cond_wait(&world_resumed, &cmm_lock);
+   th->next = threads;
+   threads = th;
+   num_threads++;
+   self = th;
+   UNLOCK;
+
+   use_heap(default_heap);
+}
+
+
+void cmm_thread_unregister(void)
+{
+   if (!self) {
+      warn("thread is not registered\n");
+      return;
+   }
+
+   LOCK;
+   while (_cmm_stop_requested)
+      park();
+   while (self->muts) {
+      mutator_t *m = self->muts;
+      use_heap(m->h);
+      CMM_UNROOT(m->transients);
+      release_cursors(m);
+      mutator_t **pm = &mutators;
+      while (*pm != m)
+         pm = &(*pm)->next;
+      *pm = m->next;
+      self->muts = m->next_of_thread;
+      if (conc_marking)
+         flush_satb(m);
+      free(m->satb);
+      free(m->curs);
+      free(m);
+   }
+   thread_t **pth = &threads;
+   while (*pth != self)
+      pth = &(*pth)->next;
+   *pth = self->next;
+   num_threads--;
+   /* a thread waiting in stop_world may now proceed */
+   pthread_cond_broadcast(&world_stopped);
+   UNLOCK;
+
+   free(self);
+   self = NULL;
+   me = NULL;
+   cur_heap = NULL;
+   _cmm_heap = NULL;
+   _cmm_hmap = NULL;
+   _cmm_cards = NULL;
+   cursors = NULL;
+   _cmm_num_cursors = 0;
+   _cmm_transients = NULL;
+}
+
+
+cmm_heap_t *cmm_heap_select(cmm_heap_t *h)
+{
+   if (!self) {
+      warn("thread is not registered\n");
+      abort();
+   }
+   cmm_heap_t *prev = cur_heap;
+   use_heap(h ? h : default_heap);
+   return prev;
+}
+
+
+cmm_heap_t *cmm_heap_current(void)
+{
+   return cur_heap;
 }
 
 
 mt_t cmm_regtype(const char *n, size_t s, 
                 clear_func_t c, mark_func_t *m, finalize_func_t *f)
 {
-   if (!heap) {
+   if (!cur_heap) {
       warn("library not initialized (call cmm_init first)\n");
       abort();
    }
@@ -1418,6 +3199,7 @@ mt_t cmm_regtype(const char *n, size_t s,
       abort();
    }
 
+   LOCK;
    /* check if type is already registered */
    for (int t = 0; t <= types_last; t++) {
       if (0==strcmp(types[t].name, n)) {
@@ -1426,36 +3208,40 @@ mt_t cmm_regtype(const char *n, size_t s,
          assert(c == types[t].clear);
          assert(m == types[t].mark);
          assert(f == types[t].finalize);
+         UNLOCK;
          return t;
       }
    }
 
    /* register new memtype */
-   types_last++;
-   if (types_last == types_size) {
+   if (types_last+1 == types_size) {
+      /* other threads read types without locking */
+      stop_world();
       debug("enlarging type directory\n");
       types_size *= 2;
       types = (typerec_t*)realloc(types, types_size*sizeof(typerec_t));
       assert(types);
+      start_world();
    }
-   assert(types_last < types_size);
-   assert(types_last < num_blocks);
+   assert(types_last+1 < types_size);
 
-   typerec_t *rec = &(types[types_last]);
+   typerec_t *rec = &(types[types_last+1]);
    rec->name = strdup(n);
-   VALGRIND_CHECK_MEM_IS_DEFINED(types[types_last].name, strlen(n)+1);
+   VALGRIND_CHECK_MEM_IS_DEFINED(rec->name, strlen(n)+1);
    rec->size = MIN_HUNKSIZE * (s/MIN_HUNKSIZE);
    while (rec->size < s)
       rec->size += MIN_HUNKSIZE;
    rec->clear = c;
    rec->mark = m;
    rec->finalize = f;
-   if (rec->size > 0) {
-      rec->current_a = 0;
-      rec->current_amax = rec->current_a + AMAX(rec->size);
-      rec->next_b = types_last;
-   }
-   return types_last;
+   rec->partial_b = -1;
+   rec->full_b = -1;
+   rec->unswept_b = -1;
+   rec->nblocks = 0;
+   rec->span = false;
+   mt_t t = ++types_last;
+   UNLOCK;
+   return t;
 }
 
 
@@ -1540,6 +3326,87 @@ char *cmm_strdup(C99_CONST char *str)
 }
 
 
+static size_t cmm_sizeof(C99_CONST void *p);
+
+/*
+ * Resize a variable-sized object. Large objects are resized in
+ * place when the mapping can grow (or shrink) where it is, other
+ * objects are copied to a new one of the same type. p stays valid
+ * until it becomes unreachable.
+ */
+void *cmm_realloc(void *p, size_t s)
+{
+   assert(ADDRESS_VALID(p));
+   if (s == 0) {
+      warn("attempt to allocate object of size zero\n");
+      abort();
+   }
+   FIX_SIZE(s);
+
+   if (!INHEAP(p)) {
+      LOCK;
+      long i = find_managed(p);
+      if (i<0 || BLOB(managed[i])) {
+         warn("not a managed address or not resizable\n");
+         abort();
+      }
+      info_t *info = (info_t*)unseal(p);
+      if ((info->flags & INFO_LARGE) && s >= los_threshold) {
+         size_t n0 = LOS_MAPSIZE(info->nh);
+         size_t n1 = LOS_MAPSIZE(s/MIN_HUNKSIZE);
+         if (n0 == n1 || mremap(info, n0, n1, 0) != MAP_FAILED) {
+            los_size += n1 - n0;
+            info->nh = s/MIN_HUNKSIZE;
+            UNLOCK;
+            /* a collect stops the world, not with cmm_lock held */
+            if (n1 > n0)
+               maybe_trigger_collect(n1 - n0);
+            return p;
+         }
+      }
+      UNLOCK;
+   }
+
+   mt_t t = cmm_typeof(p);
+   size_t n = cmm_sizeof(p);
+   void *q = (t >= mt_blob8 && t <= mt_blob) ? cmm_blob(s) : cmm_allocv(t, s);
+   memcpy(q, p, min(n, s));
+   return q;
+}
+
+/* keep s free heap bytes when releasing memory, 0 queries */
+size_t cmm_retain_free(size_t s)
+{
+   size_t prev = retain_target;
+   if (s > 0)
+      retain_target = s;
+   return prev;
+}
+
+/* pace collects to p percent of the live volume, 0 stops pacing, */
+/* -1 queries                                                      */
+int cmm_gc_percent(int p)
+{
+   int prev = pace_percent;
+   if (p >= 0) {
+      LOCK;
+      pace_percent = p;
+      set_thresholds();
+      UNLOCK;
+   }
+   return prev;
+}
+
+/* objects of s bytes or more are mapped on their own, 0 queries */
+size_t cmm_large_threshold(size_t s)
+{
+   size_t prev = los_threshold;
+   if (s > 0)
+      los_threshold = s;
+   return prev;
+}
+
+
 void cmm_manage(C99_CONST void *p)
 {
    if (!ADDRESS_VALID(p)) {
@@ -1551,8 +3418,10 @@ void cmm_manage(C99_CONST void *p)
          warn(" address 0x%lx already managed\n", PPTR(p));
          abort();
       }
+   LOCK;
    add_managed(p);
    MARK_BLOB(managed[man_last]);
+   UNLOCK;
    cmm_anchor(p);
 }
 
@@ -1573,15 +3442,17 @@ void cmm_notify(C99_CONST void *p, bool set)
          warn("not a managed address\n");
          abort();
       }
+      /* other threads may be allocating next to p */
       if (set)
-         HMAP_MARK_NOTIFY(a);
+         __atomic_or_fetch(&HMAP_WORD(a, nbits), HMAP_BIT(a), __ATOMIC_RELAXED);
       else
-         HMAP_UNMARK_NOTIFY(a);
+         __atomic_and_fetch(&HMAP_WORD(a, nbits), ~HMAP_BIT(a), __ATOMIC_RELAXED);
 
       return;
    }
 
-   int i = managed[man_last]==p ? man_last : find_managed(p);
+   LOCK;
+   long i = managed[man_last]==p ? man_last : find_managed(p);
    if (i<0) {
       warn("not a managed address\n");
       abort();
@@ -1591,6 +3462,7 @@ void cmm_notify(C99_CONST void *p, bool set)
    } else {
       UNMARK_NOTIFY(managed[i]);
    }
+   UNLOCK;
 }
 
 
@@ -1603,13 +3475,16 @@ bool cmm_ismanaged(C99_CONST void *p)
       ptrdiff_t a = ((char *)p) - heap;
       if (a>=0 && a<(long)heapsize)
          return HMAP_MANAGED(a);
-      else if (mark_in_progress)
+
+      /* managed is not modified while marking, */
+      /* markers look into it without locking   */
+      if (mark_in_progress)
          return _find_managed(p) != -1;
-      else {
-         if (!collect_in_progress)
-            update_man_k();
-         return find_managed(p) != -1;
-      }
+
+      LOCK;
+      bool m = find_managed(p) != -1;
+      UNLOCK;
+      return m;
    }
 }
 
@@ -1618,14 +3493,14 @@ mt_t cmm_typeof(C99_CONST void *p)
 {
    assert(ADDRESS_VALID(p));
    if (INHEAP(p))
-      return blockrecs[BLOCK(p)].t;
+      return heap_type((char *)p - heap);
    else {
-      int i = _find_managed(p);
+      if (!mark_in_progress) LOCK;
+      long i = _find_managed(p);
       assert(i>-1);
-      if (BLOB(managed[i]))
-         return mt_blob;
-      else
-         return INFO_T(managed[i]);
+      mt_t t = BLOB(managed[i]) ? mt_blob : INFO_T(managed[i]);
+      if (!mark_in_progress) UNLOCK;
+      return t;
    }
 }
 
@@ -1633,15 +3508,17 @@ mt_t cmm_typeof(C99_CONST void *p)
 static size_t cmm_sizeof(C99_CONST void *p)
 {
    assert(ADDRESS_VALID(p));
-   if (INHEAP(p))
-      return types[blockrecs[BLOCK(p)].t].size;
+   if (INHEAP(p)) {
+      mt_t t = blockrecs[BLOCK(p)].t;
+      return types[t].span ? SPAN_INFO(p, t)->nh*MIN_HUNKSIZE : types[t].size;
+   }
    else {
-      int i = _find_managed(p);
+      if (!mark_in_progress) LOCK;
+      long i = _find_managed(p);
       assert(i>-1);
-      if (BLOB(managed[i]))
-         return 0;
-      else
-         return INFO_S(managed[i]);
+      size_t s = BLOB(managed[i]) ? 0 : INFO_S(managed[i]);
+      if (!mark_in_progress) UNLOCK;
+      return s;
    }
 }
 
@@ -1650,18 +3527,23 @@ void cmm_root(const void *_pr)
 {
    void **pr = (void **)_pr;
 
+   /* jea: would judy arrays minimize cache-fills and be faster here than linear search? */
+
+   if ((*pr) && !cmm_ismanaged(*pr)) {
+      warn("root does not contain a managed address\n");
+      warn("*(0x%" "lx" ") = 0x%" "lx" "\n", PPTR(pr), PPTR(*pr));
+      abort();
+   }
+
+   LOCK;
    /* avoid creating duplicates */
    for (int i = roots_last; i >= 0 ; i--) {
       if (roots[i] == pr) {
          debug("attempt to add existing root (ignored)\n");
+         UNLOCK;
          return;
       }
    }
-   if ((*pr) && !cmm_ismanaged(*pr)) {
-      warn("root does not contain a managed address\n");
-      warn("*(0x%" "lx" ") = 0x%" "lx" "\n", PPTR(pr), PPTR(*pr));
-      abort();
-   }
 
    roots_last++;
    if (roots_last == roots_size) {
@@ -1673,6 +3555,7 @@ void cmm_root(const void *_pr)
 
    assert(roots_last < roots_size);
    roots[roots_last] = pr;
+   UNLOCK;
 }
 
 
@@ -1680,9 +3563,11 @@ void cmm_unroot(const void *_pr)
 {
    void **pr = (void **)_pr;
 
+   LOCK;
    assert(roots_last>=0);
    if (roots[roots_last] == pr) {
       roots_last--;
+      UNLOCK;
       return;
    }
 
@@ -1693,37 +3578,146 @@ void cmm_unroot(const void *_pr)
       if (r_found)
          roots[i] = roots[i+1];
    }
-   
-   if (r_found)
-      roots_last--;
-   else
-      warn("attempt to unroot non-existing root\n");
+   
+   if (r_found)
+      roots_last--;
+   else
+      warn("attempt to unroot non-existing root\n");
+   UNLOCK;
+}
+
+/* the marking stack is malloc'ed, mark_stack is configurable */
+#define WITH_TEMP_STORAGE   { \
+   stack = (C99_CONST void **)malloc(stack_size*sizeof(void *)); \
+   ABORT_WHEN_OOM(stack);
+
+#define TEMP_STORAGE  \
+   free(stack); \
+   stack = NULL; }
+
+/* push root objects, but for transient stacks unless with_stacks */
+STATICFUNC void push_roots(bool with_stacks)
+{
+   for (int r = 0; r <= roots_last; r++) {
+      if (*roots[r]) {
+         if (!cmm_ismanaged(*roots[r])) {
+            warn("root at 0x%" "lx" " is not a managed address\n",
+                 PPTR(roots[r]));
+            abort();
+         }
+         if (!with_stacks && cmm_typeof(*roots[r]) == mt_stack)
+            continue;
+         _cmm_push(*roots[r]);
+      }
+   }
+}
+
+/*
+ * Generational collects
+ *
+ * In cmm_mode_generational, survivors keep their live bits
+ * (live_flip does not flip), so marked objects are the old
+ * generation. A minor collect does not trace through them and
+ * only sweeps blocks allocated from since the last collect
+ * (blockrec young). CMM_WRITE sets the card of an object it
+ * stores into, and a minor collect traces from roots plus the
+ * old objects on dirty cards. Malloc'ed objects have no room for
+ * a sticky bit: minor collects keep all of them, and trace from
+ * those CMM_WRITE stored into since the last collect (man_dirty),
+ * the others still point to what that collect marked. A major
+ * collect clears the marks and collects all, when the old
+ * generation has grown by OLD_GROWTH percent.
+ */
+
+/* CMM_WRITE into malloc'ed o */
+void _cmm_remember(C99_CONST void *o)
+{
+   LOCK;
+   long i = _find_managed(o);
+   if (i > -1)
+      man_dirty[i] = 1;
+   UNLOCK;
+}
+
+/* push what old objects may point to that is new */
+STATICFUNC void mark_remembered(void)
+{
+   uintptr_t v[SELECT_MAX];
+   for (long b = 0; b < heap_top; b++) {
+      unsigned char *c = cards + b*CARDS_PER_BLOCK;
+      bool dirty = false;
+      for (int k = 0; k < CARDS_PER_BLOCK; k++)
+         dirty |= c[k];
+      if (!dirty)
+         continue;
+      int n;
+      for (uintptr_t o = 0; blockrecs[b].in_use &&
+              (n = block_select(b, sel_live, live_flip, v, &o)); )
+         for (int j = 0; j < n; j++) {
+            if (!c[(v[j] - b*BLOCKSIZE) >> CARD_SHIFT])
+               continue;
+            mark_func_t *mark = types[heap_type(v[j])].mark;
+            if (mark)
+               mark(heap + v[j]);
+         }
+      memset(c, 0, CARDS_PER_BLOCK);
+   }
+
+   for (long i = 0; i <= man_k; i++) {
+      if (!man_dirty[i])
+         continue;
+      man_dirty[i] = 0;
+      mark_func_t *mark = types[INFO_T(managed[i])].mark;
+      if (mark)
+         mark(CLRPTR(managed[i]));
+   }
+
+   /* written without barrier */
+   for (mutator_t *m = mutators; m; m = m->next) {
+      mark_stack(m->transients);
+      for (stack_chunk_t *c = m->transients->current; c; c = c->prev)
+         mark_stack_chunk(c);
+   }
 }
 
-#define WITH_TEMP_STORAGE   { \
-   C99_CONST void *marking_stack[stack_size]; \
-   stack = marking_stack;
+/* before a major collect, all objects count as new */
+STATICFUNC void clear_marks(void)
+{
+   for (long b = 0; b < heap_top; b++) {
+      unsigned int *w = PLANE(HBLOCK(hmap, b), lbits);
+      for (int i = 0; i < HMAP_WPB; i++)
+         w[i] = live_flip;
+      memset(cards + b*CARDS_PER_BLOCK, 0, CARDS_PER_BLOCK);
+   }
+   memset(man_dirty, 0, man_last + 1);
+}
 
-#define TEMP_STORAGE  \
-   stack = NULL; }
+STATICFUNC void mark_finalizable(void);
 
 STATICFUNC void mark(void)
 {
    mark_in_progress = true;
+   if (minor_collect)
+      mark_remembered();
 
-   /* Trace live objects from root objects */
-   for (int r = 0; r <= roots_last; r++) {
-      if (*roots[r]) {
-         if (!cmm_ismanaged(*roots[r])) {
-            warn("root at 0x%" "lx" " is not a managed address\n",
-                 PPTR(roots[r]));
-            abort();
-         }
-         if (*roots[r]) __cmm_push(*roots[r]);
-      }
+   if (num_markers > 1) {
+      mark_parallel(num_markers);
+      trace_from_stack();
+   } else {
+      /* Trace live objects from root objects */
+      push_roots(true);
+      trace_from_stack();
    }
-   trace_from_stack();
+   mark_finalizable();
+
+   assert(empty());
+   mark_in_progress = false;
+}
+
+STATICFUNC void mark_finalizable(void)
+{
 
+#if 0
    /* Mark dependencies of finalization-enabled objects */
    DO_HEAP (a, b) {
       finalize_func_t *finalize = types[blockrecs[b].t].finalize;
@@ -1746,312 +3740,973 @@ STATICFUNC void mark(void)
          UNMARK_LIVE(managed[i]); /* break cycles */
       }
    } DO_MANAGED_END;
+#endif
 
-   assert(empty());
-   mark_in_progress = false;
+
+   /* Mark dependencies of finalization-enabled objects, */
+   /* only blocks of such types and spans may hold them  */
+   uintptr_t v[SELECT_MAX];
+   for (long b = 0; b < heap_top; b++) {
+      typerec_t *tr = &types[blockrecs[b].t];
+      if (blockrecs[b].in_use == 0 || !(tr->finalize || tr->span))
+         continue;
+      int k;
+      for (uintptr_t o = 0; (k = block_select(b, sel_dead, live_flip, v, &o)); )
+         for (int j = 0; j < k; j++) {
+            uintptr_t a = v[j];
+            mt_t t = heap_type(a);
+            finalize_func_t *finalize = types[t].finalize;
+            mark_func_t *mark = types[t].mark;
+            if (!HMAP_LIVE(a) && finalize) {
+               void *p = heap + a;
+               if (mark) mark(p);
+               trace_from_stack();
+               HMAP_UNMARK_LIVE(a);  /* break cycles */
+            }
+         }
+   }
+   
+   { 
+      long __lasti = collect_in_progress ? man_k : man_last;   // DO_MANAGED(i)
+      for (long i = 0; i <= __lasti; i++) { {                  // DO_MANAGED(i)
+	    mt_t t = ((((uintptr_t)(managed[i])) & 4) ? mt_blob : ((info_t *)(unseal((char *)managed[i])))->t); // mt_t t = INFO_T(managed[i]);
+	    finalize_func_t *finalize = types[t].finalize;
+	    mark_func_t *mark = types[t].mark;
+	    if (!(((uintptr_t)(managed[i])) & 1) && finalize) {  // if (!LIVE(managed[i]) && finalize)
+	       if (mark) mark(((void *)((((uintptr_t)(managed[i])) & ~((1<<3)-1)))));
+
+	       trace_from_stack();
+	       { 
+		  managed[i] = (void *)((uintptr_t)(managed[i]) & ~1); // UNMARK_LIVE(managed[i]); /* break cycles */
+	       };
+	    }
+	 } 
+      }
+   };
 }
 
-#ifdef CMM_SNAPSHOT_GC
+/* bytes in objects marked live, but for malloc'ed blobs,  */
+/* whose size is not known; minor collects keep all of the */
+/* malloc'ed ones                                          */
+STATICFUNC size_t live_volume(void)
+{
+   size_t v = 0;
+   for (long b = 0; b < heap_top; b++) {
+      if (blockrecs[b].in_use == 0)
+         continue;
+      unsigned int *hb = HBLOCK(hmap, b);
+      int n = 0;
+      for (int i = 0; i < HMAP_WPB; i++)
+         n += __builtin_popcount(hmap_select(hb, i, sel_live, live_flip));
+      v += n*types[blockrecs[b].t].size;
+   }
+   for (long i = 0; i <= man_k; i++)
+      if (LIVE(managed[i]) || minor_collect)
+         v += INFO_S(managed[i]);
+   return v;
+}
 
-STATICFUNC int pfd_garbage[2];  /* garbage pipe for async. collect */
 
-STATICFUNC void sweep(void)
+STATICFUNC double clock_now(void)
 {
-   void *buf[NUM_TRANSFER];
-   assert(!collecting_child);
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec + 1e-9*ts.tv_nsec;
+}
 
-   int n = 0;
+/* account for a stop of the world that began at t0 */
+STATICFUNC void end_pause(double t0)
+{
+   double t = clock_now() - t0;
+   num_pauses++;
+   pause_total += t;
+   pause_max = max(pause_max, t);
+}
 
-   /* objects in small object heap */
-   DO_HEAP(a, b) {
-      if (!HMAP_LIVE(a)) {
-         if (blockrecs[b].t == mt_stack_chunk) /* ignore stack chunks */
-            continue;
-         buf[n++] = (void *)(heap + a);
-         if (n == NUM_TRANSFER) {
-            write(pfd_garbage[1], &buf, NUM_TRANSFER*sizeof(void *));
-            n = 0;
-         }
-      }
-   } DO_HEAP_END;
+/* epilogue, then give back what is no longer needed */
+STATICFUNC void finish_collect(void)
+{
+   collect_epilogue();
+   d();
+   release_free_blocks();
+#ifdef __GLIBC__
+   if (offheap_freed >= TRIM_VOLUME) {
+      malloc_trim(0);
+      offheap_freed = 0;
+   }
+#endif
+}
+
+/*
+ * Snapshot collects
+ *
+ * In cmm_mode_snapshot, a collect forks a child with the world
+ * stopped. The child marks its copy of the heap into a copy of
+ * hmap in memory shared with the parent (snap), adds the live
+ * bits of managed[] and the live volume, and writes a byte to
+ * pfd_garbage when done. The parent goes on allocating meanwhile,
+ * then sweeps what the child did not mark in batches of
+ * SNAPSHOT_SWEEP blocks (fetch_unreachables). The snapshot does
+ * not change under the child and unreachable objects stay
+ * unreachable, so this is safe; objects allocated after the fork
+ * are not in the child's hmap. The parent's live bits stay clear,
+ * which is why collect_epilogue does not flip them.
+ */
+
+#define SNAPSHOT_SWEEP  64     /* blocks swept per fetch_unreachables */
+#define MANAGED_SWEEP   4096   /* managed[] entries likewise */
 
-   buf[n++] = NULL;
-   if (n == NUM_TRANSFER) {
-      write(pfd_garbage[1], &buf, NUM_TRANSFER*sizeof(void *));
-      n = 0;
+/* map what the child shares, world stopped, false if that fails */
+STATICFUNC bool snapshot_map(void)
+{
+   size_t hsize = (heap_top*HBLOCK_SIZE + PAGESIZE - 1) & ~(size_t)(PAGESIZE - 1);
+   size_t size = hsize + sizeof(size_t) + (man_k + 1)/8 + 1;
+   void *m = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+   if (m == MAP_FAILED) {
+      warn("could not map marks for GC: %s\n", strerror(errno));
+      return false;
    }
+   snap.map = m;
+   snap.size = size;
+   snap.marks = (unsigned int *)m;
+   snap.msize = hsize;
+   snap.live = (size_t *)((char *)m + hsize);
+   snap.man_live = (unsigned char *)(snap.live + 1);
+   snap.top = heap_top;
+   snap.b = 0;
+   snap.i = 0;
+   snap.done = false;
+   return true;
+}
 
-   /* malloc'ed objects */
-   DO_MANAGED(i) {
-      if (!LIVE(managed[i])) {
-         buf[n++] = (void *)i;
-         if (n == NUM_TRANSFER) {
-            write(pfd_garbage[1], &buf, NUM_TRANSFER*sizeof(void *));
-            n = 0;
-         }
-      }
-   } DO_MANAGED_END;
-   
-   if (n)
-      write(pfd_garbage[1], &buf, n*sizeof(void *));
+/* mark in the child, into the shared copy of hmap when it can be */
+/* moved over ours, which also saves the copy-on-write faults      */
+STATICFUNC void mark_snapshot(void)
+{
+   size_t n = snap.top*HBLOCK_SIZE;
+   memcpy(snap.marks, hmap, n);
+   bool moved = snap.msize &&
+      mremap(snap.marks, snap.msize, snap.msize, MREMAP_MAYMOVE|MREMAP_FIXED,
+             hmap) != MAP_FAILED;
+   WITH_TEMP_STORAGE {
+      mark();
+   } TEMP_STORAGE;
+   if (!moved)
+      memcpy(snap.marks, hmap, n);
+
+   for (long i = 0; i <= man_k; i++)
+      if (LIVE(managed[i]))
+         snap.man_live[i/8] |= 1 << (i%8);
+   *snap.live = live_volume();
 }
 
+/* close all file descriptors except essential ones */
+STATICFUNC void close_file_descriptors(void)
+{
+   DIR *d = opendir("/proc/self/fd");
+   if (!d)
+      return;  /* keep them, not fatal */
+
+   int fd_dir = dirfd(d);
+   int fd_err = fileno(stderr);
+   int fd_log = fileno(stdlog);
+   int fd_parent = pfd_garbage[1];
+   struct dirent *e;
+   while ((e = readdir(d))) {
+      int fd = isdigit(e->d_name[0]) ? atoi(e->d_name) : -1;
+      if (!(fd==-1 || fd==fd_dir || fd==fd_err || fd==fd_log || fd==fd_parent))
+         (void)close(fd); /* ignore close errors */
+   }
+   closedir(d);
+}
 
-/* fill buffer */
-STATICFUNC int _fetch_unreachables(void *buf)
+/* the collecting child, does not return */
+STATICFUNC void snapshot_child(void)
 {
-   errno = 0;
-   int n = read(pfd_garbage[0], buf, NUM_TRANSFER*sizeof(void *));
+   /* leave signals to the parent */
+   static const int ignored[] = {
+      SIGHUP, SIGINT, SIGQUIT, SIGPIPE, SIGALRM, SIGPWR, SIGURG, SIGPOLL,
+      SIGUSR1, SIGUSR2, SIGCHLD, SIGWINCH
+   };
+   struct sigaction sa;
+   memset(&sa, 0, sizeof(sa));
+   sa.sa_handler = SIG_IGN;
+   for (size_t k = 0; k < sizeof(ignored)/sizeof(ignored[0]); k++)
+      sigaction(ignored[k], &sa, NULL);
+   sigset_t mask;
+   sigemptyset(&mask);
+   sigprocmask(SIG_SETMASK, &mask, NULL);
+
+   close_file_descriptors();
+
+   num_markers = 1;  /* marker threads are not forked */
+   mark_snapshot();
+
+   if (write(pfd_garbage[1], "", 1) != 1)
+      _exit(1);
+   _exit(0);
+}
 
-   if (n == -1) {
-      if (errno != EAGAIN) {
-         char *errmsg = strerror(errno);
-         warn("error reading from garbage pipe\n");
-         warn(errmsg);
-         abort();
-      }
-      
-   } else if (n == 0) {
-      /* we're done */
+/* fork a collecting child, world stopped, false if that fails */
+STATICFUNC bool collect_snapshot(void)
+{
+   if (pipe(pfd_garbage) == -1) {
+      warn("could not set up pipe for GC: %s\n", strerror(errno));
+      return false;
+   }
+   fcntl(pfd_garbage[0], F_SETFD, FD_CLOEXEC);
+   fcntl(pfd_garbage[1], F_SETFD, FD_CLOEXEC);
+
+   collect_prologue();
+   if (!snapshot_map()) {
+      close(pfd_garbage[0]);
+      close(pfd_garbage[1]);
+      collect_in_progress = false;
+      return false;
+   }
+
+   fflush(stdout);
+   fflush(stdlog);
+   pid_t pid = fork();
+   if (pid == -1) {
+      warn("could not spawn child for GC: %s\n", strerror(errno));
       close(pfd_garbage[0]);
-      collect_epilogue();
+      close(pfd_garbage[1]);
+      munmap(snap.map, snap.size);
+      collect_in_progress = false;
+      return false;
+   }
+   if (pid == 0)
+      snapshot_child();
+
+   debug("spawned gc child %d\n", (int)pid);
+   collecting_child = pid;
+   close(pfd_garbage[1]);
+   int flags = fcntl(pfd_garbage[0], F_GETFL);
+   fcntl(pfd_garbage[0], F_SETFL, flags | O_NONBLOCK);
+   return true;
+}
+
+/* reap the child, which signalled ok or not, world stopped */
+STATICFUNC void reap_child(bool ok)
+{
+   close(pfd_garbage[0]);
+   int status;
+   pid_t pid;
+   while ((pid = waitpid(collecting_child, &status, 0)) == -1 && errno == EINTR)
+      ;
+   /* the application may have reaped it already */
+   if (pid != -1 && !(WIFEXITED(status) && WEXITSTATUS(status) == 0))
+      ok = false;
+   snap.done = true;
+   if (!ok) {
+      warn("gc child failed, some garbage is left\n");
+      *snap.live = live_bytes;
+      snap.b = snap.top;
+      snap.i = man_k + 1;
+   }
+}
+
+/* the collect is done, world stopped */
+STATICFUNC void end_snapshot(void)
+{
+   munmap(snap.map, snap.size);
+   finish_collect();
+}
+
+/* sweep a batch of what the child did not mark, world stopped */
+STATICFUNC int sweep_shared(void)
+{
+   int n = 0;
+   uintptr_t v[SELECT_MAX];
+   for (long e = min(snap.b + SNAPSHOT_SWEEP, snap.top); snap.b < e; snap.b++) {
+      if (blockrecs[snap.b].in_use == 0)
+         continue;
+      unsigned int *hb = HBLOCK(snap.marks, snap.b);
+      int k;
+      for (uintptr_t o = 0; (k = hblock_select(snap.b, hb, sel_dead, live_flip, v, &o)); ) {
+         for (int j = 0; j < k; j++)
+            reclaim_inheap(heap + v[j]);
+         n += k;
+      }
+   }
+   if (snap.b < snap.top)
+      return n;
+
+   for (long e = min(snap.i + MANAGED_SWEEP, man_k + 1); snap.i < e; snap.i++) {
+      if (!(snap.man_live[snap.i/8] & (1 << (snap.i%8)))) {
+         reclaim_offheap(snap.i);
+         n++;
+      }
    }
+   if (snap.i <= man_k)
+      return n;
 
+   live_bytes = *snap.live;
+   end_snapshot();
    return n;
 }
 
-/* fetch addresses of unreachable objects from garbage pipe */
-/* return number of objects reclaimed */
-STATICFUNC int fetch_unreachables(void)
+/* wait for the collecting child if asked to, then sweep a batch */
+/* of what it did not mark, return number reclaimed              */
+STATICFUNC int fetch_unreachables(bool wait)
 {
    if (gc_disabled) {
       fetch_backlog++;
       return 0;
    }
+   /* don't stop the world for nothing */
+   struct pollfd pfd = { pfd_garbage[0], POLLIN, 0 };
+   if (!snap.done && poll(&pfd, 1, wait ? 10 : 0) == 0)
+      return 0;
+
+   int n = 0;
+   double t0 = clock_now();
+   LOCK;
+   stop_world();
+   if (collecting_child && !snap.done) {
+      char c;
+      ssize_t r = read(pfd_garbage[0], &c, 1);
+      if (r >= 0)
+         reap_child(r == 1);
+      else if (errno != EAGAIN && errno != EINTR) {
+         warn("error reading from gc pipe: %s\n", strerror(errno));
+         abort();
+      }
+   }
+   if (collecting_child && snap.done) {
+      DISABLE_GC;
+      n = sweep_shared();
+      ENABLE_GC;
+   }
+   end_pause(t0);
+   start_world();
+   UNLOCK;
+   return n;
+}
 
-   static void *buf[NUM_TRANSFER];
-   static int j, n = 0;
-   static bool inheap = true;
+/*
+ * Incremental collects
+ *
+ * In cmm_mode_incremental, a collect pushes the roots with the
+ * world stopped and returns. Marking then goes on in slices of at
+ * most slice_us, run by the allocator when it takes a run or a
+ * span no sooner than slice_us after the last slice, and by
+ * cmm_idle. CMM_WRITE shades what is stored grey (_cmm_shade),
+ * so no white object hides behind a black one. Objects made
+ * meanwhile are white, and the transient stacks are not traced
+ * until the final remark, which pushes all roots again, traces
+ * what is left and sweeps.
+ */
 
-   if (n) {
-      /* don't need to disable gc here as gc is still in progress */
-      if (inheap) {
-         if (buf[j])
-            reclaim_inheap(buf[j]);
-         else
-            inheap = false;
+#define SLICE_CHECK  64   /* objects traced between clock reads */
 
-         if (++j == n) {
-            n = 0;
-            return 1;
-         }
-         
-         if (inheap) {
-            if (buf[j])
-               reclaim_inheap(buf[j]);
-            else
-               inheap = false;
-
-            if (++j == n)
-               n = 0;
-            return 2;
-         }
+STATICFUNC void shade_concurrent(C99_CONST void *p);
 
-      } else {
-         reclaim_offheap((int)buf[j++]);
-         if (j == n) {
-            n = 0;
-            return 1;
-         }
-         reclaim_offheap((int)buf[j++]);
-         if (j == n) {
-            n = 0;
-         }
-         return 2;
+/* barrier of CMM_WRITE replacing old by p */
+void _cmm_shade(C99_CONST void *old, C99_CONST void *p)
+{
+   if (!cur_heap)
+      return;
+   if (conc_marking) {
+      shade_concurrent(old);
+      return;
+   }
+   if (!incr_marking || !p)
+      return;
+   ptrdiff_t a = ((char *)p) - heap;
+   if (a >= 0 && (unsigned long)a < heapsize &&
+       (!HMAP_MANAGED(a) || HMAP_LIVE(a)))
+      return;
+   LOCK;
+   if (incr_marking && cmm_ismanaged(p) && try_mark_live(p))
+      push_grey(p);
+   UNLOCK;
+}
+
+/* with the world stopped */
+STATICFUNC void start_incremental(void)
+{
+   collect_prologue();
+   stack = (C99_CONST void **)malloc(stack_size*sizeof(void *));
+   ABORT_WHEN_OOM(stack);
+   push_roots(false);
+   incr_marking = true;
+   __atomic_add_fetch(&_cmm_marking, 1, __ATOMIC_RELEASE);
+   slice_due = clock_now() + 1e-6*slice_us;
+}
+
+/* trace until t0 + slice_us, return true when nothing is grey */
+STATICFUNC bool trace_slice(double t0)
+{
+   double end = t0 + 1e-6*slice_us;
+   for (;;) {
+      for (int k = 0; k < SLICE_CHECK && !empty(); k++) {
+         C99_CONST void *p = marking_object = pop();
+         mt_t t = marking_type = cmm_typeof(p);
+         if (types[t].mark)
+            types[t].mark(p);
+      }
+      if (empty()) {
+         if (!stack_overflowed)
+            return true;
+         recover_stack();
       }
+      if (clock_now() >= end)
+         return false;
+   }
+}
+
+/* remark and sweep with the world stopped, return objects reclaimed */
+STATICFUNC int finish_incremental(void)
+{
+   mark_in_progress = true;
+   retire_cursors();
+   man_k = man_last;           /* what was malloc'ed meanwhile is white */
+   push_roots(true);
+   trace_from_stack();
+   mark_finalizable();
+   mark_in_progress = false;
+   incr_marking = false;
+   __atomic_sub_fetch(&_cmm_marking, 1, __ATOMIC_RELEASE);
+
+   live_bytes = live_volume();
+   defer_sweep();
+   int n = num_markers > 1 ? sweep_parallel(num_markers) : sweep_now();
+   free(stack);
+   stack = NULL;
+   finish_collect();
+   return n;
+}
 
-   } else if (n == 0) {
+/* one slice of marking, and the remark once nothing is grey; */
+/* stores keep shading objects, so do not wait for a slice    */
+/* that begins with nothing grey                               */
+STATICFUNC void mark_increment(void)
+{
+   double t0 = clock_now();
+   LOCK;
+   stop_world();
+   if (incr_marking) {
+      mark_in_progress = true;
+      bool done = trace_slice(t0);
+      mark_in_progress = false;
+      if (done)
+         finish_incremental();
+      else
+         slice_due = clock_now() + 1e-6*slice_us;
+   }
+   end_pause(t0);
+   start_world();
+   UNLOCK;
+}
 
-      n = _fetch_unreachables(&buf);
-      
-      if (n == -1) {
-         n = 0;
+/*
+ * Concurrent collects
+ *
+ * In cmm_mode_concurrent, a collect pushes the roots and what the
+ * transient stacks hold with the world stopped and returns. The
+ * heap's marker thread (conc_main) then traces while the mutators
+ * run, in batches of CONC_BATCH objects. The deque is the
+ * marker's own, so a batch runs without cmm_lock; other threads
+ * hand it grey objects through conc_in, and stop_world waits for
+ * a batch to end, which ends early when a stop is requested. The
+ * marker leaves the transient stacks alone, they change without
+ * barrier and the remark pushes them anyway. Marking is
+ * snapshot-at-the-beginning (Yuasa): CMM_WRITE shades the value
+ * it overwrites (shade_concurrent), and objects made meanwhile
+ * are marked (allocated black). Once the marker has run out of
+ * grey objects, the allocator or cmm_idle stop the world for the
+ * remark, which traces what stores shaded since, pushes the roots
+ * and stacks again, traces what is left and sweeps; stores keep
+ * shading objects, so it does not wait for an empty deque. When
+ * the mutators allocate another threshold's worth before that,
+ * the remark comes anyway and finishes the trace.
+ */
 
-      } else if (n == 0) {
-         inheap = true;
+#define CONC_BATCH   256   /* objects traced between stop checks */
+#define SATB_BUFFER  256   /* objects shaded per cmm_lock hold */
 
-      } else {
-         assert((n%sizeof(void *)) == 0);
-         n = n/sizeof(void *);
-         j = 0;
+STATICFUNC void clear_soft_dirty(void);
+STATICFUNC void rescan_dirty(void);
+
+/* hand what m shaded to the marker, cmm_lock held */
+STATICFUNC void flush_satb(mutator_t *m)
+{
+   for (int i = 0; i < m->satb_n; i++)
+      APPEND(conc_in, num_conc_in, size_conc_in, m->satb[i]);
+   m->satb_n = 0;
+   pthread_cond_broadcast(&conc_wake);
+}
+
+/* move what was handed to the marker into its deque, cmm_lock */
+/* held and the marker not tracing                             */
+STATICFUNC void take_conc_in(void)
+{
+   for (long i = 0; i < num_conc_in; i++)
+      deque_push(conc, conc_in[i]);
+   num_conc_in = 0;
+}
+
+/* heap objects are marked without cmm_lock and buffered per */
+/* mutator, so stores do not fight the marker for the lock   */
+STATICFUNC void shade_concurrent(C99_CONST void *p)
+{
+   if (!p)
+      return;
+   ptrdiff_t a = ((char *)p) - heap;
+   if (a >= 0 && (unsigned long)a < heapsize) {
+      if (!HMAP_MANAGED(a) || HMAP_LIVE(a) || !try_mark_live(p))
+         return;
+      if (!me->satb) {
+         me->satb = (C99_CONST void **)malloc(SATB_BUFFER*sizeof(void *));
+         ABORT_WHEN_OOM(me->satb);
       }
+      me->satb[me->satb_n++] = p;
+      if (me->satb_n == SATB_BUFFER) {
+         LOCK;
+         flush_satb(me);
+         UNLOCK;
+      }
+      return;
    }
-   return 0;
+   LOCK;
+   if (conc_marking && cmm_ismanaged(p) && try_mark_live(p)) {
+      APPEND(conc_in, num_conc_in, size_conc_in, p);
+      pthread_cond_broadcast(&conc_wake);
+   }
+   UNLOCK;
 }
 
-/* close all file descriptors except essential ones */
-STATICFUNC void close_file_descriptors(void)
+/* the marker thread of heap h */
+STATICFUNC void *conc_main(void *h)
 {
-   assert(collect_in_progress && collecting_child==0);
+   cur_heap = (cmm_heap_t *)h;
+   marker = conc;
+   LOCK;
+   while (!conc_quit) {
+      if (_cmm_stop_requested) {
+         pthread_cond_wait(&world_resumed, &cmm_lock);
+         continue;
+      }
+      take_conc_in();
+      if (!conc_marking || deque_empty(conc)) {
+         pthread_cond_wait(&conc_wake, &cmm_lock);
+         continue;
+      }
+      conc_tracing++;
+      UNLOCK;
+      int k = 0;
+      C99_CONST void *p;
+      while (k++ < CONC_BATCH &&
+             !__atomic_load_n(&_cmm_stop_requested, __ATOMIC_ACQUIRE) &&
+             (p = deque_pop(conc))) {
+         mt_t t = conc->cur_type = cmm_typeof(p);
+         conc->cur_object = p;
+         if (types[t].mark && t != mt_stack && t != mt_stack_chunk)
+            types[t].mark(p);
+      }
+      LOCK;
+      conc_tracing--;
+      pthread_cond_broadcast(&world_stopped);
+      if (deque_empty(conc) && !num_conc_in)
+         conc_drained = true;
+   }
+   UNLOCK;
+   return NULL;
+}
 
-   char path[128];
-   sprintf(path, "/proc/%d/fd", (int)getpid());
-   
-   errno = 0;
-   DIR *d = opendir(path);
-   if (!d) {
-      char *errmsg = strerror(errno);
-      warn("could not open %s: %s\n", path, errmsg);
-      abort();
+/* transient stacks change without barrier, push what they hold */
+STATICFUNC void push_stacks(void)
+{
+   for (int r = 0; r <= roots_last; r++) {
+      C99_CONST void *p = *roots[r];
+      if (!p || cmm_typeof(p) != mt_stack)
+         continue;
+      cmmstack_t *st = (cmmstack_t *)p;
+      try_mark_live(st);
+      for (stack_chunk_t *c = st->current; c; c = c->prev)
+         try_mark_live(c);
+      mark_stack(st);
+      for (stack_chunk_t *c = st->current; c; c = c->prev)
+         mark_stack_chunk(c);
    }
-   
-   int fd_err = fileno(stderr);
-   int fd_log = fileno(stdlog);
-   int fd_parent = pfd_garbage[1];
-   errno = 0;
-   struct dirent *e = readdir(d);
-   while (e != NULL) {
-      int fd = isdigit(e->d_name[0]) ? atoi(e->d_name) : -1;
-      if (!(fd==-1 || fd==fd_err || fd==fd_log || fd==fd_parent))
-         (void)close(fd); /* ignore close errors */
-      errno = 0;
-      e = readdir(d);
+}
+
+/* with the world stopped */
+STATICFUNC void start_concurrent(void)
+{
+   collect_prologue();
+   if (!conc) {
+      conc = (marker_t *)calloc(1, sizeof(marker_t));
+      ABORT_WHEN_OOM(conc);
+      conc->buf = (C99_CONST void **)malloc(stack_size*sizeof(void *));
+      ABORT_WHEN_OOM(conc->buf);
+      conc->mask = stack_size - 1;
+      conc->grows = true;
    }
-   if (errno) {
-      char *errmsg = strerror(errno);
-      debug("error while closing file descriptors:\n%s\n", errmsg);
-      /* don't abort, hopefully nothing serious */
+   conc->top = conc->bottom = 0;
+   conc->overflowed = false;
+
+   mark_in_progress = true;
+   marker = conc;
+   push_roots(false);
+   push_stacks();
+   marker = NULL;
+   mark_in_progress = false;
+
+   if (gc_mode == cmm_mode_concurrent)
+      __atomic_add_fetch(&_cmm_marking, 1, __ATOMIC_RELEASE);
+   else
+      clear_soft_dirty();
+   conc_marking = true;
+   conc_drained = false;
+   if (!conc_started) {
+      if (pthread_create(&conc_thread, NULL, conc_main, cur_heap)) {
+         warn("cannot start marker thread\n");
+         abort();
+      }
+      conc_started = true;
    }
-   closedir(d);
+   pthread_cond_broadcast(&conc_wake);
+}
+
+/* trace what the marker left, world stopped */
+STATICFUNC void drain_concurrent(void)
+{
+   C99_CONST void *p;
+   while ((p = deque_pop(conc))) {
+      mt_t t = marking_type = cmm_typeof(p);
+      marking_object = p;
+      if (types[t].mark)
+         types[t].mark(p);
+   }
+}
+
+/* remark and sweep with the world stopped, return objects reclaimed */
+STATICFUNC int finish_concurrent(void)
+{
+   mark_in_progress = true;
+   marker = conc;
+   for (mutator_t *m = mutators; m; m = m->next)
+      flush_satb(m);
+   take_conc_in();
+   drain_concurrent();
+   if (gc_mode == cmm_mode_mostly_concurrent) {
+      rescan_dirty();
+      drain_concurrent();
+   }
+   marker = NULL;
+   conc_marking = false;
+   if (gc_mode == cmm_mode_concurrent)
+      __atomic_sub_fetch(&_cmm_marking, 1, __ATOMIC_RELEASE);
+
+   retire_cursors();
+   man_k = man_last;           /* what was malloc'ed meanwhile is black */
+   stack = (C99_CONST void **)malloc(stack_size*sizeof(void *));
+   ABORT_WHEN_OOM(stack);
+   stack_overflowed = conc->overflowed;
+   push_roots(false);
+   push_stacks();
+   trace_from_stack();
+   mark_finalizable();
+   mark_in_progress = false;
+
+   live_bytes = live_volume();
+   defer_sweep();
+   int n = num_markers > 1 ? sweep_parallel(num_markers) : sweep_now();
+   free(stack);
+   stack = NULL;
+   finish_collect();
+   return n;
 }
 
+/* the remark, from the allocator or cmm_idle */
+STATICFUNC void end_concurrent(void)
+{
+   double t0 = clock_now();
+   LOCK;
+   stop_world();
+   if (conc_marking)
+      finish_concurrent();
+   end_pause(t0);
+   start_world();
+   UNLOCK;
+}
 
-STATICFUNC void collect(void)
+/* stop and join the marker thread, before the heap goes */
+STATICFUNC void stop_concurrent(void)
 {
-   /* set up pipe for garbage */
-   errno = 0;
-   if (pipe(pfd_garbage) == -1) {
-      char *errmsg = strerror(errno);
-      warn("could not set up pipe for GC: %s\n", errmsg);
+   LOCK;
+   if (!conc_started) {
+      UNLOCK;
       return;
    }
+   conc_quit = true;
+   pthread_cond_broadcast(&conc_wake);
+   UNLOCK;
+   pthread_join(conc_thread, NULL);
+   conc_started = false;
+}
 
-   collect_prologue();
+/*
+ * Mostly concurrent collects
+ *
+ * cmm_mode_mostly_concurrent marks like cmm_mode_concurrent, but
+ * without a barrier, so stores need no CMM_WRITE (Boehm, Demers &
+ * Shenker, PLDI 1991). The start clears the soft-dirty bits of
+ * the process (/proc/self/clear_refs), and the remark retraces the
+ * live objects in blocks on pages written since, as read from
+ * /proc/self/pagemap, and all live malloc'ed ones. Without
+ * soft-dirty bits in the kernel the heap collects synchronously
+ * instead, as the remark would pause about as long as a
+ * synchronous mark; when another heap cleared them meanwhile, all
+ * blocks count as written.
+ */
 
-   /* fork */
-   assert(!collecting_child);
-   fflush(stdout);
-   if (stdlog) fflush(stdlog);
-   errno = 0;
-   collecting_child = fork();
-   if (collecting_child == -1) {
-      char *errmsg = strerror(errno);
-      warn("could not spawn child for GC (%s)\n", errmsg);
-      warn("trying synchronous collect\n"); /* in maybe_trigger_collect */
-      //fprintf(stderr, "could not spawn child for GC: %s\n", errmsg);
-      close(pfd_garbage[0]);
-      close(pfd_garbage[1]);
-      collecting_child = 0;
-      collect_in_progress = false;
-      return;
+#define PM_SOFT_DIRTY  (1ULL << 55)   /* in /proc/self/pagemap entries */
+#define PM_BATCH       512            /* entries read at once */
 
-   } else if (collecting_child) {
-      cmm_printf("spawned gc child %d\n", collecting_child); /*jea debug: uncocmmented */
+static int soft_dirty = -1;           /* kernel tracks them, -1 unknown */
+static int soft_dirty_clears = 0;
+static int pagemap_fd = -1;
 
-      /* jea add 2 lines */
-      FILE* collect_log = fopen("/home/jaten/dj/strongref/libccmm/child_gc.log","w");
-      fprintf(collect_log,"in collecting child, pid %d  , with parent pid %d \n", getpid(), getppid());
-      sync();
+/* return the soft-dirty bit of the page at p, or -1 */
+STATICFUNC int page_dirty(C99_CONST void *p)
+{
+   uint64_t e;
+   off_t o = ((uintptr_t)p >> PAGEBITS)*sizeof(e);
+   return pread(pagemap_fd, &e, sizeof(e), o) == sizeof(e) ? !!(e & PM_SOFT_DIRTY) : -1;
+}
 
-      close(pfd_garbage[1]);
-      int flags = fcntl(pfd_garbage[0], F_GETFL);
-      fcntl(pfd_garbage[0], F_SETFL, flags | O_NONBLOCK);
-      return;
+STATICFUNC bool write_clear_refs(void)
+{
+   int fd = open("/proc/self/clear_refs", O_WRONLY);
+   if (fd < 0)
+      return false;
+   bool ok = write(fd, "4", 1) == 1;
+   close(fd);
+   return ok;
+}
 
-   } else {
-      /* first thing, change the signal set up */
-      struct sigaction sa;
-      memset(&sa, 0, sizeof(sa));
-      sigset_t *mask = &(sa.sa_mask);
-      assert(sigfillset(mask) != -1);
-      assert(sigprocmask(SIG_SETMASK, mask, NULL) != -1);
-
-      sa.sa_handler = SIG_IGN;
-      assert(sigaction(SIGHUP,  &sa, NULL) != -1);
-      assert(sigaction(SIGINT,  &sa, NULL) != -1);
-      assert(sigaction(SIGQUIT, &sa, NULL) != -1);
-      assert(sigaction(SIGPIPE, &sa, NULL) != -1);
-      assert(sigaction(SIGALRM, &sa, NULL) != -1);
-      assert(sigaction(SIGPWR,  &sa, NULL) != -1);
-      assert(sigaction(SIGURG,  &sa, NULL) != -1);
-      assert(sigaction(SIGPOLL, &sa, NULL) != -1);
-
-      sa.sa_handler = SIG_DFL;
-      assert(sigaction(SIGTERM, &sa, NULL) != -1);
-      assert(sigaction(SIGBUS,  &sa, NULL) != -1);
-      assert(sigaction(SIGFPE,  &sa, NULL) != -1);
-      assert(sigaction(SIGILL,  &sa, NULL) != -1);
-      assert(sigaction(SIGSEGV, &sa, NULL) != -1);
-      assert(sigaction(SIGSYS,  &sa, NULL) != -1);
-      assert(sigaction(SIGXCPU, &sa, NULL) != -1);
-      assert(sigaction(SIGXFSZ, &sa, NULL) != -1);
-      
-      assert(sigemptyset(mask) != -1);
-      sigprocmask(SIG_SETMASK, mask, NULL);
+/* see if a page written after clearing comes back dirty */
+STATICFUNC bool probe_soft_dirty(void)
+{
+   pagemap_fd = open("/proc/self/pagemap", O_RDONLY);
+   if (pagemap_fd < 0)
+      return false;
+   volatile char *m = (volatile char *)mmap(NULL, PAGESIZE, PROT_READ|PROT_WRITE,
+                                            MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+   if (m == MAP_FAILED)
+      return false;
+   m[0] = 1;
+   bool ok = write_clear_refs() && page_dirty((void *)m) == 0;
+   m[0] = 2;
+   ok = ok && page_dirty((void *)m) == 1;
+   munmap((void *)m, PAGESIZE);
+   if (!ok) {
+      close(pagemap_fd);
+      pagemap_fd = -1;
+   }
+   return ok;
+}
 
-      /* second thing, close unused file descriptors */
-      close_file_descriptors();
+/* whether the kernel tracks soft-dirty bits, cmm_lock held */
+STATICFUNC bool has_soft_dirty(void)
+{
+   if (soft_dirty == -1) {
+      soft_dirty = probe_soft_dirty();
+      debug("soft-dirty bits %s\n", soft_dirty ? "available" : "unavailable");
    }
+   return soft_dirty;
+}
 
-   WITH_TEMP_STORAGE {
-      mark();
-      sweep();
-   } TEMP_STORAGE;
+/* with the world stopped */
+STATICFUNC void clear_soft_dirty(void)
+{
+   if (has_soft_dirty() && !write_clear_refs())
+      soft_dirty = 0;
+   conc_clears = ++soft_dirty_clears;
+}
 
-   close(pfd_garbage[1]);
-   if (stdlog) fclose(stdlog);
-   _exit(0);
+/* flag the blocks on pages written since clear_soft_dirty */
+STATICFUNC void dirty_blocks(unsigned char *dirty)
+{
+   if (!soft_dirty || conc_clears != soft_dirty_clears) {
+      memset(dirty, 1, heap_top);
+      return;
+   }
+   uintptr_t p0 = (uintptr_t)heap >> PAGEBITS;
+   uintptr_t p1 = ((uintptr_t)heap + heap_top*BLOCKSIZE - 1) >> PAGEBITS;
+   uint64_t e[PM_BATCH];
+   for (uintptr_t p = p0; p <= p1; p += PM_BATCH) {
+      long n = min((long)PM_BATCH, (long)(p1 - p + 1));
+      ssize_t r = pread(pagemap_fd, e, n*sizeof(e[0]), p*sizeof(e[0]));
+      for (long i = 0; i < n; i++) {
+         if (r == n*(ssize_t)sizeof(e[0]) && !(e[i] & PM_SOFT_DIRTY))
+            continue;
+         char *a = (char *)((p + i) << PAGEBITS);
+         long b0 = max((a - heap)/BLOCKSIZE, 0L);
+         long b1 = min((a + PAGESIZE - 1 - heap)/BLOCKSIZE, heap_top - 1);
+         for (long b = b0; b <= b1; b++)
+            dirty[b] = 1;
+      }
+   }
 }
 
+/* retrace live objects that may have been written while marking; */
+/* the transient stacks are pushed afresh, see push_stacks          */
+STATICFUNC void rescan_dirty(void)
+{
+   unsigned char *dirty = (unsigned char *)calloc(heap_top + 1, 1);
+   ABORT_WHEN_OOM(dirty);
+   dirty_blocks(dirty);
+
+   /* a span is written where its first block is */
+   for (long b = heap_top - 1; b > 0; b--)
+      if (dirty[b] && blockrecs[b].list == bl_span && blockrecs[b].in_use == 0)
+         dirty[b - 1] = 1;
+
+   uintptr_t v[SELECT_MAX];
+   for (long b = 0; b < heap_top; b++) {
+      typerec_t *tr = &types[blockrecs[b].t];
+      if (!dirty[b] || blockrecs[b].in_use == 0 || !(tr->mark || tr->span))
+         continue;
+      int k;
+      for (uintptr_t o = 0; (k = block_select(b, sel_live, live_flip, v, &o)); )
+         for (int j = 0; j < k; j++) {
+            mt_t t = heap_type(v[j]);
+            if (types[t].mark && t != mt_stack && t != mt_stack_chunk)
+               types[t].mark(heap + v[j]);
+         }
+   }
+   free(dirty);
+
+   for (long i = 0; i <= man_last; i++) {
+      if (!LIVE(managed[i]) || BLOB(managed[i]))
+         continue;
+      mt_t t = INFO_T(managed[i]);
+      if (types[t].mark && t != mt_stack && t != mt_stack_chunk)
+         types[t].mark(CLRPTR(managed[i]));
+   }
+}
 
+/* start a collect in the mode of the heap */
 STATICFUNC void cmm_collect(void)
 {
    if (gc_disabled || collect_in_progress) {
       collect_requested = true;
       return;
-
-   } else
-      collect();
+   }
+   if (gc_mode == cmm_mode_snapshot) {
+      int c = num_collects;
+      double t0 = clock_now();
+      LOCK;
+      stop_world();
+      bool ok = collect_in_progress || num_collects != c || collect_snapshot();
+      end_pause(t0);
+      start_world();
+      UNLOCK;
+      if (ok)
+         return;
+      /* else collect synchronously */
+   }
+   if (gc_mode == cmm_mode_incremental) {
+      int c = num_collects;
+      double t0 = clock_now();
+      LOCK;
+      stop_world();
+      if (!collect_in_progress && num_collects == c)
+         start_incremental();
+      end_pause(t0);
+      start_world();
+      UNLOCK;
+      return;
+   }
+   if (gc_mode == cmm_mode_mostly_concurrent) {
+      LOCK;
+      if (!has_soft_dirty()) {
+         debug("no soft-dirty bits, collecting synchronously\n");
+         gc_mode = cmm_mode_sync;
+      }
+      UNLOCK;
+   }
+   if (gc_mode == cmm_mode_concurrent ||
+       gc_mode == cmm_mode_mostly_concurrent) {
+      int c = num_collects;
+      double t0 = clock_now();
+      LOCK;
+      stop_world();
+      if (!collect_in_progress && num_collects == c)
+         start_concurrent();
+      end_pause(t0);
+      start_world();
+      UNLOCK;
+      return;
+   }
+   collect_sync(gc_mode == cmm_mode_generational);
 }
 
-#endif  /* CMM_SNAPSHOT_GC */
-
 int cmm_collect_now(void)
 {
+   return collect_sync(false);
+}
+
+/* collect with the world stopped; with minor set, a generational */
+/* heap reclaims new objects only, unless a major collect is due  */
+STATICFUNC int collect_sync(bool minor)
+{
+   d();
+
    if (gc_disabled) {
       collect_requested = true;
       return 0;
    } 
-#ifdef CMM_SNAPSHOT_GC   
-   else if (collect_in_progress) {
-      int n = 0;
-      while (collect_in_progress)
-         n += fetch_unreachables();
-      return n;
+
+   /* finish a snapshot collect under way, it may have missed */
+   /* garbage made since, so collect again                    */
+   int n = 0;
+   while (collecting_child)
+      n += fetch_unreachables(true);
+
+   int c = num_collects;
+
+   double t0 = clock_now();
+   LOCK;
+   stop_world();
+   if (incr_marking || conc_marking) {
+      /* as above for an incremental or concurrent collect */
+      n += incr_marking ? finish_incremental() : finish_concurrent();
+      c = num_collects;
+   }
+   if (num_collects != c || collect_in_progress) {
+      /* another thread collected while we were waiting */
+      start_world();
+      UNLOCK;
+      return n + (collect_in_progress ? collect_sync(minor) : 0);
    }
-#else
-   assert(!collect_in_progress);
-#endif
 
    collect_prologue();
-
-   int n = 0;
+   if (gc_mode == cmm_mode_generational) {
+      minor_collect = minor && live_bytes < old_limit && man_last < old_man_limit;
+      if (!minor_collect)
+         clear_marks();
+   }
+   d();
+   
    WITH_TEMP_STORAGE {
       mark();
-      n = sweep_now();
+      d();
+      live_bytes = live_volume();
+      defer_sweep();
+      n = num_markers > 1 ? sweep_parallel(num_markers) : sweep_now();
+      d();
    } TEMP_STORAGE;
 
-   collect_epilogue();
+   finish_collect();
+   end_pause(t0);
+   start_world();
+   UNLOCK;
    return n;
 }
 
@@ -2064,32 +4719,48 @@ bool cmm_collect_in_progress(void)
 
 bool cmm_idle(void)
 {
-   static int ncalls = 0;
+   static CMM_TLS int ncalls = 0;
 
-   if (collect_in_progress) {
+   cmm_safepoint();
+   if (collecting_child) {
       if (!gc_disabled) {
-         int i = 100 + fetch_backlog;
-         while (i>0 && collect_in_progress) {
-            fetch_unreachables();
+         int i = 1 + fetch_backlog;
+         fetch_backlog = 0;
+         while (i>0 && collecting_child) {
+            fetch_unreachables(false);
             i--;
          }
          return true;
       } else
          return false;
 
+   } else if (incr_marking) {
+      if (gc_disabled)
+         return false;
+      mark_increment();
+      return true;
+
+   } else if (conc_marking) {
+      if (gc_disabled || !conc_drained)
+         return false;
+      end_concurrent();
+      return true;
+
    } else {
       ncalls++;
-      if (!collect_in_progress)
-         update_man_k();
-      if (ncalls<NUM_IDLE_CALLS) {
+      LOCK;
+      if (!collect_in_progress && num_unswept) {
+         if (!sweep_some(IDLE_SWEEP))
+            release_free_blocks();
+         UNLOCK;
+         return true;
+      }
+      UNLOCK;
+      if (ncalls<idle_period) {
          return false;
       }
       /* create some work for ourselves */
-#ifdef CMM_SNAPSHOT_GC
       cmm_collect();
-#else
-      cmm_collect_now();
-#endif
       ncalls = 0;
       return true;
    }
@@ -2100,14 +4771,24 @@ bool cmm_begin_nogc(bool dont_block)
 {
    /* block when a collect is in progress */
    if (!dont_block) {
-#ifdef CMM_SNAPSHOT_GC
-      if (collecting_child && gc_disabled) {
+      if ((collecting_child || incr_marking || conc_marking) && gc_disabled) {
          warn("deadlock (CMM_NOGC while pending GC paused)\n");
          abort();
       }
       while (collecting_child)
-         fetch_unreachables();
-#endif
+         fetch_unreachables(true);
+      if (incr_marking) {
+         double t0 = clock_now();
+         LOCK;
+         stop_world();
+         if (incr_marking)
+            finish_incremental();
+         end_pause(t0);
+         start_world();
+         UNLOCK;
+      }
+      if (conc_marking)
+         end_concurrent();
       assert(!collect_in_progress);
    }
 
@@ -2120,18 +4801,15 @@ bool cmm_begin_nogc(bool dont_block)
 void cmm_end_nogc(bool nogc)
 {
    gc_disabled = nogc;
-#ifdef CMM_SNAPSHOT_GC
-   if (collect_in_progress && !gc_disabled && fetch_backlog) {
-      while (collect_in_progress && fetch_backlog>0)
-         fetch_backlog -= fetch_unreachables();
-   } 
-#endif
-   if (collect_requested && !gc_disabled) {
-      cmm_collect();
-      if (!collect_in_progress)
-         /* could not spawn child, do it synchronously */
-         cmm_collect_now();
+   if (gc_disabled)
+      return;
+   while (collecting_child && fetch_backlog > 0) {
+      fetch_backlog--;
+      if (!fetch_unreachables(false))
+         break;
    }
+   if (collect_requested)
+      cmm_collect();
 }
 
 STATICFUNC void mark_refs(void **p)
@@ -2147,109 +4825,95 @@ STATICFUNC void clear_refs(void **p, size_t s)
 }
 
 
-void cmm_init(int npages, notify_func_t *clnotify, FILE *log)
+/* set up the heap cur_heap points to */
+STATICFUNC void init_heap(const cmm_config_t *cfg)
 {
-   assert(sizeof(info_t) <= MIN_HUNKSIZE);
-   assert(sizeof(hunk_t) <= MIN_HUNKSIZE);
-   assert((1<<HMAP_EPI_BITS) == HMAP_EPI);
-   assert(sizeof(stack_chunk_t) == BLOCKSIZE);
-
-   /* initial heap can be no bigger than 1GB */
-   double bytes_requested = (double)npages * (double)PAGESIZE;
-   if(!(bytes_requested <= (double)(1 << 30))) {
-      fprintf(stderr,"cmm_init(npages=%d) is too big at %.6f GB: not allowed "
-	      "to request more than 1GB heap. "
-	      "(PAGESIZE=%d *  npages=%d == total requested bytes in decimal: %.0f\n", 
-	      npages, 
-	      (bytes_requested / (double)(1<<30)),
-	      PAGESIZE, 
-	      npages, 
-	      bytes_requested );
-      assert((double)npages * (double)PAGESIZE <= (double)(1 << 30));
-   }
-
-   client_notify = clnotify;
+   client_notify = cfg->notify;
+   block_bits = __builtin_ctzl(cfg->block_size);
    
-   if (log) {
-      cmm_debug_enabled = true;
-      stdlog = log;
-   } else {
-      cmm_debug_enabled = false;
-      stdlog = stderr;
+   stdlog = cfg->log ? cfg->log : stderr;
+   free_b = -1;
+   released_b = -1;
+   retain_target = cfg->retain_free;
+   los_threshold = cfg->large_threshold;
+   cfg_block_threshold = cfg->block_trigger;
+   cfg_volume_threshold = cfg->volume_trigger;
+   idle_period = cfg->idle_calls;
+   pace_percent = cfg->gc_percent;
+   pace_limit = cfg->soft_max_heap;
+   gc_mode = cfg->mode;
+   slice_us = cfg->max_pause_us;
+   man_last = -1;
+   man_k = -1;
+   man_is_compact = true;
+   roots_last = -1;
+   types_last = -1;
+   stack_size = cfg->mark_stack;
+   stack_last = -1;
+   marking_type = mt_undefined;
+   pthread_cond_init(&conc_wake, NULL);
+
+   /* reserve address space for the small-object heap, */
+   /* commit npages of it (less when that fails)        */
+   num_blocks = max(((long)PAGESIZE*cfg->npages)/BLOCKSIZE, (long)MIN_NUMBLOCKS);
+   max_blocks = max((long)(cfg->max_heap/BLOCKSIZE), num_blocks);
+   huge_mode = cfg->huge_pages;
+   page_unit = huge_mode == cmm_huge_off ? PAGESIZE : HUGE_SIZE;
+   if (huge_mode == cmm_huge_tlbfs) {
+      /* the pool does not grow, neither does the heap */
+      max_blocks = num_blocks;
+      if (!(heap = (char *)reserve(max_blocks*BLOCKSIZE, true))) {
+         debug("no hugetlbfs pages, using transparent huge pages\n");
+         huge_mode = cmm_huge_thp;
+         max_blocks = max((long)(cfg->max_heap/BLOCKSIZE), num_blocks);
+      }
    }
-
-   if (heap) {
-      warn("cmm is already initialized\n");
-      return;
+   for (;;) {
+      if (huge_mode != cmm_huge_tlbfs)
+         heap = (char *)reserve(max_blocks*BLOCKSIZE, false);
+      hmap = (unsigned int *)reserve(max_blocks*HBLOCK_SIZE, false);
+      blockrecs = (blockrec_t *)reserve(max_blocks*sizeof(blockrec_t), false);
+      cards = (unsigned char *)reserve(max_blocks*CARDS_PER_BLOCK, false);
+      free_map = (unsigned long *)reserve(FREE_MAPSIZE(max_blocks), false);
+      if (heap && hmap && blockrecs && cards && free_map)
+         break;
+      if (huge_mode != cmm_huge_tlbfs)
+         unreserve(heap, max_blocks*BLOCKSIZE);
+      unreserve(hmap, max_blocks*HBLOCK_SIZE);
+      unreserve(blockrecs, max_blocks*sizeof(blockrec_t));
+      unreserve(cards, max_blocks*CARDS_PER_BLOCK);
+      unreserve(free_map, FREE_MAPSIZE(max_blocks));
+      if (max_blocks == MIN_NUMBLOCKS || huge_mode == cmm_huge_tlbfs) {
+         warn("could not reserve heap\n");
+         abort();
+      }
+      max_blocks = max(max_blocks/2, (long)MIN_NUMBLOCKS);
+      num_blocks = min(num_blocks, max_blocks);
    }
-
-   /* allocate small-object heap */
-   num_blocks = max((PAGESIZE*npages)/BLOCKSIZE, MIN_NUMBLOCKS);
-
-   /* jea add */
-   assert(num_blocks);
-
-   num_free_blocks = num_blocks;
-   heapsize = num_blocks * BLOCKSIZE;
-   assert(heapsize); /* overflow an int? yep, if we request in bytes instead of npages, of size 4096 */
-
-   hmapsize = (heapsize/MIN_HUNKSIZE)/HMAP_EPI;
-   assert(hmapsize); /* overflow */
-
-   block_threshold = min((long)MAX_BLOCKS, (long)(num_blocks/3));
-   volume_threshold = min(MAX_VOLUME, heapsize/2);
-#ifdef CMM_SNAPSHOT_GC
-   block_threshold -= (block_threshold/3);
-#endif
-
-   blockrecs = (blockrec_t *)malloc(num_blocks * sizeof(blockrec_t));
-   assert(blockrecs);
-   heap = (char *) malloc(heapsize + PAGESIZE);
-   VALGRIND_MAKE_MEM_NOACCESS(heap, heapsize);
-   if (!heap) {
-      warn("could not allocate heap\n");
-      abort();
+   while (!commit_blocks(0, num_blocks)) {
+      if (num_blocks == MIN_NUMBLOCKS) {
+         warn("could not allocate heap\n");
+         abort();
+      }
+      num_blocks = max(num_blocks/2, (long)MIN_NUMBLOCKS);
    }
-
-   /* make sure heap is PAGESIZE-aligned */
-   heap = (char *)(((uintptr_t)(heap + PAGESIZE-1)) & ~(PAGESIZE-1));
+   VALGRIND_MAKE_MEM_NOACCESS(heap, num_blocks*BLOCKSIZE);
    VALGRIND_CREATE_MEMPOOL(heap, 0, 0);
 
-  /* jea add debug
-   printf("* cmm_init() debugging 2 : \n"
-	  "  heap: %p, \n"
-	  "  heap + PAGESIZE-1: %p \n"
-	  "  PAGESIZE-1: %d \n"
-	  "  (uintptr_t)(heap + PAGESIZE-1): %ld  \n"
-	  "  (((uintptr_t)(heap + PAGESIZE-1)) & ~(PAGESIZE-1)): %ld \n",
-	  heap,
-	  heap + PAGESIZE-1,
-	  PAGESIZE-1,
-	  (uintptr_t)(heap + PAGESIZE-1),
-	  (((uintptr_t)(heap + PAGESIZE-1)) & ~(PAGESIZE-1))
-      );
-  */
-
-   hmap = (unsigned int*)calloc(hmapsize, sizeof(unsigned int));
-   if (!hmap) {
-      warn("could not allocate heap map\n");
-      abort();
-   }
+   num_free_blocks = num_blocks;
+   heapsize = num_blocks*BLOCKSIZE;
+   hmapsize = num_blocks*HBLOCK_SIZE;
+   set_thresholds();
 
    assert(heapsize);
    assert(hmapsize);
 
-   debug("heapsize  : %6""ld"" KByte (%d %d KByte blocks)\n",
+   debug("heapsize  : %6""ld"" KByte (%ld %d KByte blocks)\n",
          (heapsize/(1<<10)), num_blocks, BLOCKSIZE/(1<<10));
-   debug("hmapsize  : %6""ld"" KByte\n", (hmapsize*sizeof(int))/(1<<10));
+   debug("hmapsize  : %6""ld"" KByte\n", hmapsize/(1<<10));
    debug("threshold : %6""ld"" KByte\n", volume_threshold/(1<<10));
 
-   /* initialize block records */
-   for (int i = 0; i < num_blocks; i++) {
-      blockrecs[i].t = mt_undefined;
-      blockrecs[i].in_use = 0;
-   }
-   assert(no_marked_live());
+   /* block records are set up on first use, see fresh_blocks */
 
    /* set up type directory */
    types = (typerec_t *) malloc(MIN_TYPES * sizeof(typerec_t));
@@ -2279,30 +4943,302 @@ void cmm_init(int npages, notify_func_t *clnotify, FILE *log)
       assert(mt == mt_blob);
       mt = CMM_REGTYPE("refs", 0, clear_refs, mark_refs, 0);
       assert(mt == mt_refs);
+      for (int c = 0; c < NUM_SPANS; c++) {
+         char name[16];
+         sprintf(name, "span%d", (int)span_sizes[c]);
+         /* slots above a block take whole blocks */
+         size_t s = span_sizes[c];
+         if (s > (size_t)BLOCKSIZE)
+            s = (s + BLOCKSIZE - 1) & ~(size_t)(BLOCKSIZE - 1);
+         mt = CMM_REGTYPE(name, s, 0, 0, 0);
+         assert(mt == mt_span0 + c);
+         types[mt].span = true;
+      }
    }
-   assert(types_last == mt_refs);
+   assert(types_last == mt_span0 + NUM_SPANS - 1);
 
    /* set up other bookkeeping structures */
    managed = (void **)malloc(MIN_MANAGED * sizeof(void *));
    assert(managed);
+   man_dirty = (unsigned char *)malloc(MIN_MANAGED);
+   assert(man_dirty);
    man_size = MIN_MANAGED;
+   pagemap = (long ***)calloc(1<<PM_ROOT_BITS, sizeof(long **));
+   ABORT_WHEN_OOM(pagemap);
+   pm_size = (1<<PM_ROOT_BITS)*sizeof(long **);
 
    roots = (void***)malloc(MIN_ROOTS * sizeof(void *));
    assert(roots);
    roots_size = MIN_ROOTS;
+}
+
+/* huge page backing of heaps created from now on, -1 queries */
+int cmm_huge_pages(int mode)
+{
+   int prev = huge_pages;
+   if (mode >= cmm_huge_off && mode <= cmm_huge_tlbfs)
+      huge_pages = mode;
+   return prev;
+}
+
+void cmm_config_defaults(cmm_config_t *cfg)
+{
+   memset(cfg, 0, sizeof(*cfg));
+   cfg->npages = 0x1000;
+   cfg->max_heap = MAX_HEAPSIZE;
+   cfg->mark_stack = MIN_STACK;
+   cfg->idle_calls = NUM_IDLE_CALLS;
+   cfg->mark_threads = num_markers;
+   cfg->large_threshold = LOS_THRESHOLD;
+   cfg->retain_free = RETAIN_FREE;
+   cfg->huge_pages = huge_pages;
+   cfg->mode = cmm_mode_sync;
+   cfg->max_pause_us = MAX_PAUSE_US;
+   cfg->block_size = 1<<MIN_BLOCKBITS;
+}
+
+/* reject a setting, name is the environment variable or NULL */
+STATICFUNC void invalid_config(const char *name)
+{
+   if (name)
+      warn("invalid configuration, %s=%s\n", name, getenv(name));
+   else
+      warn("invalid configuration\n");
+   abort();
+}
+
+/* size with an optional k, m or g suffix */
+STATICFUNC bool env_size(const char *name, size_t *v)
+{
+   const char *e = getenv(name);
+   if (!e || !*e)
+      return false;
+   char *end;
+   errno = 0;
+   unsigned long long n = strtoull(e, &end, 0);
+   int shift = 0;
+   switch (*end) {
+   case 'g': case 'G': shift += 10;   /* fall through */
+   case 'm': case 'M': shift += 10;   /* fall through */
+   case 'k': case 'K': shift += 10; end++;
+   }
+   if (*end) {
+      warn("ignoring %s=%s\n", name, e);
+      return false;
+   }
+   /* strtoull takes -n for 2^64 - n */
+   if (errno == ERANGE || strchr(e, '-') || n > (SIZE_MAX >> shift))
+      invalid_config(name);
+   *v = n << shift;
+   return true;
+}
+
+/* the value must fit the field, e.g. 2^32 + 1 in an int is 1 */
+#define ENV_OVERRIDE(c, field, NAME) { \
+   size_t __v; \
+   if (env_size("CMM_" NAME, &__v)) { \
+      __typeof__((c)->field) __f = (__typeof__((c)->field))__v; \
+      if ((size_t)__f != __v || __f < 0) \
+         invalid_config("CMM_" NAME); \
+      (c)->field = __f; \
+   } \
+}
+
+/* apply environment overrides, check settings */
+STATICFUNC void configure(cmm_config_t *c)
+{
+   ENV_OVERRIDE(c, npages, "NPAGES");
+   ENV_OVERRIDE(c, max_heap, "MAX_HEAP");
+   ENV_OVERRIDE(c, block_trigger, "BLOCK_TRIGGER");
+   ENV_OVERRIDE(c, volume_trigger, "VOLUME_TRIGGER");
+   ENV_OVERRIDE(c, mark_stack, "MARK_STACK");
+   ENV_OVERRIDE(c, idle_calls, "IDLE_CALLS");
+   ENV_OVERRIDE(c, mark_threads, "MARK_THREADS");
+   ENV_OVERRIDE(c, large_threshold, "LARGE_THRESHOLD");
+   ENV_OVERRIDE(c, retain_free, "RETAIN_FREE");
+   ENV_OVERRIDE(c, huge_pages, "HUGE_PAGES");
+   ENV_OVERRIDE(c, mode, "MODE");
+   ENV_OVERRIDE(c, gc_percent, "GC_PERCENT");
+   ENV_OVERRIDE(c, soft_max_heap, "SOFT_MAX_HEAP");
+   ENV_OVERRIDE(c, max_pause_us, "MAX_PAUSE_US");
+   ENV_OVERRIDE(c, block_size, "BLOCK_SIZE");
+
+   /* the mark deques index with stack_size - 1, round up and cap */
+   int s = 1;
+   while (s < c->mark_stack && s < MAX_MARK_STACK)
+      s *= 2;
+   if (c->mark_stack > 0)
+      c->mark_stack = s;
+
+   if (c->npages < 0 || c->block_trigger < 0 || c->mark_stack < 1 ||
+       c->idle_calls < 1 || c->large_threshold == 0 || c->gc_percent < 0 ||
+       c->huge_pages < cmm_huge_off || c->huge_pages > cmm_huge_tlbfs ||
+       c->mode < cmm_mode_sync || c->mode > cmm_mode_mostly_concurrent ||
+       c->max_pause_us < 1 ||
+       c->block_size < (size_t)1<<MIN_BLOCKBITS || c->block_size > (size_t)1<<MAX_BLOCKBITS ||
+       (c->block_size & (c->block_size - 1)))
+      invalid_config(NULL);
+}
+
+void cmm_init(int npages, notify_func_t *clnotify, FILE *log)
+{
+   cmm_config_t cfg;
+   cmm_config_defaults(&cfg);
+   cfg.npages = npages;
+   cfg.notify = clnotify;
+   cfg.log = log;
+   cmm_init_ex(&cfg);
+}
+
+void cmm_init_ex(const cmm_config_t *config)
+{
+   assert(sizeof(info_t) <= MIN_HUNKSIZE);
+   assert(sizeof(hunk_t) <= MIN_HUNKSIZE);
+   assert((1<<HMAP_EPI_BITS) == HMAP_EPI);
+   assert(HMAP_EPI == 8*sizeof(unsigned int));
+   assert(sizeof(stack_chunk_t) == PAGESIZE);
 
-   /* set up transient object stack */
-   *(cmmstack_t **)&_cmm_transients = make_stack();
-   CMM_ROOT(_cmm_transients);
-   assert(stack_works_fine(_cmm_transients));
+   if (default_heap) {
+      warn("cmm is already initialized\n");
+      return;
+   }
+   cmm_config_t cfg = *config;
+   configure(&cfg);
+   cmm_debug_enabled = (cfg.log != NULL);
+   cmm_mark_threads(cfg.mark_threads);
+
+   {
+      pthread_mutexattr_t attr;
+      pthread_mutexattr_init(&attr);
+      pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+      pthread_mutex_init(&cmm_lock, &attr);
+      pthread_mutexattr_destroy(&attr);
+      pthread_cond_init(&world_stopped, NULL);
+      pthread_cond_init(&world_resumed, NULL);
+   }
+
+   default_heap = cur_heap = (cmm_heap_t *)calloc(1, sizeof(cmm_heap_t));
+   ABORT_WHEN_OOM(default_heap);
+   init_heap(&cfg);
+
+   /* set up transient object stack of initial thread */
+   cmm_thread_register();
    assert(stack_empty(_cmm_transients));
 
    debug("done\n");
 }
 
-/* print diagnostic info to string */
-char *cmm_info(int level)
+
+cmm_heap_t *cmm_heap_create(int npages, notify_func_t *clnotify, FILE *log)
+{
+   cmm_config_t cfg;
+   cmm_config_defaults(&cfg);
+   cfg.npages = npages;
+   cfg.notify = clnotify;
+   cfg.log = log;
+   return cmm_heap_create_ex(&cfg);
+}
+
+cmm_heap_t *cmm_heap_create_ex(const cmm_config_t *config)
+{
+   if (!self) {
+      warn("thread is not registered\n");
+      abort();
+   }
+   cmm_config_t cfg = *config;
+   configure(&cfg);
+   /* debug code and marker threads are process-wide, see cmm.h */
+   if (cfg.mark_threads != num_markers)
+      warn("mark_threads is set by cmm_init_ex or cmm_mark_threads\n");
+
+   cmm_heap_t *prev = cur_heap;
+   cmm_heap_t *h = (cmm_heap_t *)calloc(1, sizeof(cmm_heap_t));
+   ABORT_WHEN_OOM(h);
+   cur_heap = h;
+   init_heap(&cfg);
+   cur_heap = prev;
+   return h;
+}
+
+
+/* free the heap and all objects in it, finalizers are not run */
+void cmm_heap_destroy(cmm_heap_t *h)
 {
+   if (!h || h == default_heap) {
+      warn("cannot destroy the default heap\n");
+      abort();
+   }
+
+   cmm_heap_t *prev = cur_heap;
+   cur_heap = h;
+   stop_concurrent();
+   cur_heap = prev;
+
+   LOCK;
+   stop_world();
+   for (thread_t *th = threads; th; th = th->next) {
+      if (th->current == h) {
+         warn("heap is still selected by a thread\n");
+         abort();
+      }
+   }
+
+   cur_heap = h;
+   if (collecting_child) {
+      if (!snap.done) {
+         kill(collecting_child, SIGKILL);
+         close(pfd_garbage[0]);
+         waitpid(collecting_child, NULL, 0);
+      }
+      munmap(snap.map, snap.size);
+   }
+   if (incr_marking) {
+      free(stack);
+      __atomic_sub_fetch(&_cmm_marking, 1, __ATOMIC_RELEASE);
+   }
+   if (conc_marking && gc_mode == cmm_mode_concurrent)
+      __atomic_sub_fetch(&_cmm_marking, 1, __ATOMIC_RELEASE);
+   if (conc) {
+      free(conc->buf);
+      free(conc);
+   }
+   free(conc_in);
+   pthread_cond_destroy(&conc_wake);
+   while (mutators) {
+      mutator_t *m = mutators;
+      mutators = m->next;
+      mutator_t **pm = &m->th->muts;
+      while (*pm != m)
+         pm = &(*pm)->next_of_thread;
+      *pm = m->next_of_thread;
+      free(m->satb);
+      free(m->curs);
+      free(m);
+   }
+   for (long i = 0; i <= man_last; i++) {
+      if (!OBSOLETE(managed[i]))
+         free_offheap(managed[i]);
+   }
+   for (int t = 0; t <= types_last; t++)
+      free(types[t].name);
+   free(types);
+   free(profile);
+   free(managed);
+   free(man_dirty);
+   pm_free();
+   free(roots);
+   unreserve(blockrecs, max_blocks*sizeof(blockrec_t));
+   unreserve(cards, max_blocks*CARDS_PER_BLOCK);
+   unreserve(free_map, FREE_MAPSIZE(max_blocks));
+   unreserve(hmap, max_blocks*HBLOCK_SIZE);
+   unreserve(heap, max_blocks*BLOCKSIZE);
+   cur_heap = prev;
+   start_world();
+   UNLOCK;
+
+   free(h);
+}
+
 #define PRINTBUFLEN 20000
 #define BPRINTF(...) {               \
    sprintf(buf, __VA_ARGS__);        \
@@ -2310,12 +5246,12 @@ char *cmm_info(int level)
    assert((buf-buffer)<PRINTBUFLEN);\
    }
 
-   char buffer[PRINTBUFLEN], *buf = buffer;
-   
-   if (level<=0)
-      return NULL;
+/* print diagnostic info to buffer, world stopped */
+STATICFUNC void print_info(char *buffer, int level)
+{
+   char *buf = buffer;
 
-   int    total_blocks_in_use = 0;
+   long   total_blocks_in_use = 0;
    size_t total_memory_managed = 0;
    size_t total_memory_used_by_cmm = 0;
    size_t total_objects_inheap = 0;
@@ -2325,23 +5261,18 @@ char *cmm_info(int level)
    memset(&total_objects_per_type_ih, 0, types_size*sizeof(size_t));
    memset(&total_objects_per_type_oh, 0, types_size*sizeof(size_t));
 
-   for (int i=0; i<num_blocks; i++)
-      if (blockrecs[i].in_use)
-         total_blocks_in_use++;
+   total_blocks_in_use = num_blocks - num_free_blocks;
    
-   BPRINTF("Small object heap: %.2f MByte in %d blocks (%d used)\n",
+   BPRINTF("Small object heap: %.2f MByte in %ld blocks (%ld used)\n",
            ((double)heapsize)/(1<<20), num_blocks, total_blocks_in_use);
 
    DO_HEAP(a, b) {
       total_objects_inheap++;
-      mt_t t = blockrecs[b].t;
+      mt_t t = heap_type(a);
       total_objects_per_type_ih[t]++;
-      total_memory_managed += types[t].size;
+      total_memory_managed += cmm_sizeof(heap + a);
    } DO_HEAP_END;
 
-   if (!collect_in_progress)
-      update_man_k();
-
    DO_MANAGED(i) {
       total_objects_offheap++;
       mt_t t  = INFO_T(managed[i]);
@@ -2353,11 +5284,17 @@ char *cmm_info(int level)
    BPRINTF("Managed memory   : %.2f MByte in %""ld"" + %""ld"" objects\n",
            ((double)total_memory_managed)/(1<<20),
            total_objects_inheap, total_objects_offheap);
+   BPRINTF("Large objects    : %.2f MByte mapped for %d objects\n",
+           ((double)los_size)/(1<<20), los_count);
+   BPRINTF("Released memory  : %.2f MByte in %ld blocks, %.2f MByte returned\n",
+           ((double)num_released*BLOCKSIZE)/(1<<20), num_released,
+           ((double)released_total)/(1<<20));
 
    total_memory_used_by_cmm += hmapsize;
-   total_memory_used_by_cmm += man_size*sizeof(managed[0]);
+   total_memory_used_by_cmm += man_size*(sizeof(managed[0]) + 1) + pm_size;
    total_memory_used_by_cmm += types_size*sizeof(typerec_t);
    total_memory_used_by_cmm += num_blocks*sizeof(blockrec_t);
+   total_memory_used_by_cmm += num_blocks*CARDS_PER_BLOCK;
    total_memory_used_by_cmm += stack_sizeof(_cmm_transients);
    BPRINTF("Memory used by CMM: %.2f MByte total\n",
            ((double)total_memory_used_by_cmm)/(1<<20));
@@ -2366,17 +5303,37 @@ char *cmm_info(int level)
               ((double)hmapsize)/(1<<20));
       BPRINTF("                 : %.2f MByte for offheap array\n",
               ((double)man_size*sizeof(managed[0]))/(1<<20));
+      BPRINTF("                 : %.2f MByte for page map\n",
+              ((double)pm_size)/(1<<20));
    }
    if (gc_disabled)
       BPRINTF("!!! Garbage collection is disabled !!!\n");
 
    if (level<=1)
-      return cmm_strdup(buffer);
+      return;
 
    BPRINTF("Page size        : %d bytes\n", PAGESIZE);
    BPRINTF("Block size       : %d bytes\n", BLOCKSIZE);
-   BPRINTF("GC threshold     : %d blocks / %.2f MByte\n", 
-           block_threshold, (double)volume_threshold/(1<<20));
+   BPRINTF("Huge pages       : %s\n", huge_mode == cmm_huge_tlbfs ? "hugetlbfs" :
+           huge_mode == cmm_huge_thp ? "transparent" : "off");
+   if (heap_goal) {
+      BPRINTF("GC threshold     : %.2f MByte\n", (double)volume_threshold/(1<<20));
+      BPRINTF("Pacing           : %d%% of %.2f MByte live, goal %.2f MByte",
+              pace_percent, (double)live_bytes/(1<<20), (double)heap_goal/(1<<20));
+      if (pace_limit)
+         BPRINTF(", soft max %.2f MByte", (double)pace_limit/(1<<20));
+      BPRINTF("\n");
+   } else
+      BPRINTF("GC threshold     : %ld blocks / %.2f MByte\n", 
+              block_threshold, (double)volume_threshold/(1<<20));
+   static const char *mode_names[] = {"synchronous", "snapshot", "incremental",
+                                      "generational", "concurrent", "mostly concurrent"};
+   BPRINTF("Collector        : %s, %d collects", mode_names[gc_mode], num_collects);
+   if (gc_mode == cmm_mode_generational)
+      BPRINTF(" (%d major)", num_majors);
+   BPRINTF("\n");
+   BPRINTF("GC pauses        : %d, %.3f ms max, %.3f ms total\n",
+           num_pauses, 1e3*pause_max, 1e3*pause_total);
    if (cmm_debug_enabled) {
       BPRINTF("Debug code       : enabled\n");
    } else {
@@ -2394,23 +5351,36 @@ char *cmm_info(int level)
    BPRINTF("Memory roots     : %d total, %d active\n", roots_last+1, active_roots);
    BPRINTF("Transient stack  : %d objects\n", stack_depth(_cmm_transients));
    if (level<=2)
-      return cmm_strdup(buffer);
+      return;
 
    BPRINTF("\n");
    BPRINTF(" Memory type    | size  | # inheap (blocks) | # malloced \n");
    BPRINTF("---------------------------------------------------------\n");
    
    for (int t = 0; t <= types_last; t++) {
-      int n = 0;
-      for (int b = 0; b < num_blocks; b++)
-         if (blockrecs[b].t == t)
-            n++;
-      BPRINTF(" %14s | %5""ld"" | %7""ld""  (%6d) |    %7""ld"" \n",
+      long n = types[t].nblocks;
+      BPRINTF(" %14s | %5""ld"" | %7""ld""  (%6ld) |    %7""ld"" \n",
               types[t].name,
               types[t].size,
               total_objects_per_type_ih[t], n,
               total_objects_per_type_oh[t]);
    }
+}
+
+/* print diagnostic info to string */
+char *cmm_info(int level)
+{
+   char buffer[PRINTBUFLEN];
+   
+   if (level<=0)
+      return NULL;
+
+   LOCK;
+   stop_world();
+   finish_sweep();
+   print_info(buffer, level);
+   start_world();
+   UNLOCK;
    return cmm_strdup(buffer);
 }
 
@@ -2426,6 +5396,12 @@ int cmm_prof_start(int *h)
       profile = (int*)malloc(n*sizeof(int));
       ABORT_WHEN_OOM(profile);
       memset(profile, 0, n*sizeof(int));
+      /* take every allocation through the counting slow path */
+      LOCK;
+      stop_world();
+      retire_cursors();
+      start_world();
+      UNLOCK;
    }
 
    /* initialize h */
@@ -2473,12 +5449,11 @@ char **cmm_prof_key(void)
 /* dump all of type t or all if t = mt_undefined */
 void dump_managed(mt_t t)
 {
-   cmm_printf("Dumping managed list (%d of %d in poplars)...\n",
-             man_k+1, man_last+1);
-   for (int i = 0; i <= man_last; i++) {
+   cmm_printf("Dumping managed list (%ld entries)...\n", man_last+1);
+   for (long i = 0; i <= man_last; i++) {
       mt_t ti = cmm_typeof(CLRPTR(managed[i]));
       if (t==mt_undefined || t==ti)
-         cmm_printf("%4d : %16lx, %1s%1s %20s\n", 
+         cmm_printf("%4ld : %16lx, %1s%1s %20s\n", 
                    i, PPTR(CLRPTR(managed[i])),
                    OBSOLETE(managed[i]) ? "o" : " ",
                    NOTIFY(managed[i]) ? "n" : " ",
@@ -2492,11 +5467,8 @@ void dump_types(void)
 {
    cmm_printf("Dumping type registry (%d types)...\n", types_last+1);
    for (int t = 0; t <= types_last; t++) {
-      int n = 0;
-      for (int b = 0; b < num_blocks; b++)
-         if (blockrecs[b].t == t)
-            n++;
-      cmm_printf("%3d: %15s  %4""ld"" 0x%lx 0x%lx  0x%lx (%d in freelist)\n",
+      long n = types[t].nblocks;
+      cmm_printf("%3d: %15s  %4""ld"" 0x%lx 0x%lx  0x%lx (%ld in freelist)\n",
                 t,
                 types[t].name,
                 types[t].size,
@@ -2513,10 +5485,10 @@ void dump_types(void)
 void dump_roots(void)
 {
    cmm_printf("Dumping roots...\n");
-   for (int r = 0; r <= roots_last; r++)
+   for (int r = 0; r <= roots_last; r++) {
       cmm_printf(" loc 0x%lx --> 0x%lx\n", 
-                PPTR(roots[r]), PPTR(*(roots[r])));
-
+		 PPTR(roots[r]), PPTR(*(roots[r])));
+   }
    cmm_printf("\n");
    fflush(stdlog);
 }
@@ -2547,9 +5519,9 @@ void dump_heap_stats(void)
 {
    int counts[types_size];
    memset(counts, 0, sizeof(counts));
-   int num_ih = 0;
+   long num_ih = 0;
 
-   for (int i = 0; i<=man_last; i++) {
+   for (long i = 0; i<=man_last; i++) {
       counts[cmm_typeof(CLRPTR(managed[i]))]++;
       if (INHEAP(managed[i])) num_ih++;
    }
@@ -2558,10 +5530,61 @@ void dump_heap_stats(void)
    for (int t = 0; t <= types_last; t++)
       cmm_printf(" [%3d] %15s : %8d\n",
                 t, types[t].name, counts[t]);
-   cmm_printf(" total : %d, in heap %d\n\n", man_last+1, num_ih);
+   cmm_printf(" total : %ld, in heap %ld\n\n", man_last+1, num_ih);
 }
 
 
+void dump(const char* where, int line, void*  cmmstack_t_ptr ) {
+
+   cmmstack_t* st = (cmmstack_t*)cmmstack_t_ptr;
+
+   printf("\n&&&&&&&&&&&&&&&&&&&&&&&&&=========================\n");
+   printf("&&&&&& BEGIN     %s   : line %d\n",where,line);
+   printf("&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&\n");
+ 
+
+
+   printf("\n=========================\n");
+   printf("dump_types:\n");
+   dump_types();
+
+
+   printf("\n=========================\n");
+   printf("dump_stats:\n");
+   dump_heap_stats();
+
+// can't do this here, because mem_info can
+   // spawn a collection, -> infinite loop.
+//   printf("\n=========================\n");
+//   printf("mem_info(3) %s:\n",cmm_info(3));
+
+   printf("\n=========================\n");
+   printf("dump_stack(st):");
+   if (st) {
+      printf("\n");
+      dump_stack(st);
+   } else {
+      printf("  -- st was null, not calling dump_stack(st) -- \n");
+   }
+
+   printf("\n=========================\n");
+   printf("dump_stack_depth:\n");
+   dump_stack_depth();
+
+   printf("\n=========================\n");
+   printf("dump_roots:\n");
+   dump_roots();
+   
+   printf("\n=========================\n");
+   printf("dump_managed:\n");
+   dump_managed(mt_undefined);
+
+   printf("\n&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&\n");
+   printf("&&&&&& END     %s   : line %d\n",where,line);
+   printf("&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&\n");
+
+}
+
 
 #ifdef __cplusplus
 }
@@ -71,20 +71,8 @@ extern "C" {
 #define NVALGRIND
 #define CMM_SIZE_MAX    (UINT32_MAX * MIN_HUNKSIZE)
 
-/* 
-   CMM_SNAPSHOT_GC turns on the feature that
-   forks a child process to do garbage collection 
-   concurrently in the background. If snapshots are
-   used, the child process communicates
-   the mark-and-sweep results back to
-   the parent process using a pipe.
-
-   Without this, GC is done synchronously
-   in this same process, when cmm_collect_now()
-   or cmm_idle() is called.
-*/
-
-// #define CMM_SNAPSHOT_GC
+/* per-thread state shared with the inline code in cmm_private.h */
+#define CMM_TLS         __thread __attribute__((tls_model("initial-exec")))
 
 typedef void clear_func_t(void *, size_t);
 typedef void mark_func_t(C99_CONST void *);
@@ -92,6 +80,7 @@ typedef bool finalize_func_t(void *);
 typedef void notify_func_t(void *);
 
 typedef short mt_t;
+typedef struct cmm_heap cmm_heap_t;
 
 /* pre-defined memory types */
 enum mt {
@@ -107,17 +96,97 @@ enum mt {
    mt_refs      =  9,
 };
 
+/* huge page backing, see cmm_huge_pages */
+enum cmm_huge {
+   cmm_huge_off   = 0,
+   cmm_huge_thp   = 1,                    // transparent huge pages
+   cmm_huge_tlbfs = 2,                    // hugetlbfs, else transparent
+};
+
+/* how a heap collects, see cmm_config_t; a snapshot collect forks */
+/* a child that marks a copy of the process into shared memory,    */
+/* then cmm_idle and the allocator reclaim what it left unmarked,  */
+/* and cmm_collect_now collects synchronously; an incremental      */
+/* collect marks in slices of max_pause_us between allocations and */
+/* cmm_idle calls; a generational heap mostly collects the objects */
+/* made since the last collect, cmm_collect_now collects all; a    */
+/* concurrent heap marks on a thread of its own while the mutators */
+/* run; these need CMM_WRITE for stores of pointers; a mostly      */
+/* concurrent heap does too, but finds stores from soft-dirty bits */
+/* of the pages written, so it needs no CMM_WRITE; without these   */
+/* bits in the kernel it collects synchronously                    */
+enum cmm_mode {
+   cmm_mode_sync         = 0,             // stop the world, mark and sweep
+   cmm_mode_snapshot     = 1,             // mark a forked copy in the background
+   cmm_mode_incremental  = 2,             // mark in short slices, see CMM_WRITE
+   cmm_mode_generational = 3,             // minor and major collects, see CMM_WRITE
+   cmm_mode_concurrent   = 4,             // mark on a background thread, see CMM_WRITE
+   cmm_mode_mostly_concurrent = 5,        // likewise, remark pages written meanwhile
+};
+
+/* settings for cmm_init_ex, start from cmm_config_defaults;   */
+/* CMM_<FIELD> environment variables (e.g. CMM_NPAGES) override; */
+/* cmm_heap_create_ex takes the same settings for its heap, but  */
+/* mark_threads and whether debug code runs are process-wide:    */
+/* there log only redirects the heap's output, see cmm_debug and */
+/* cmm_mark_threads                                              */
+typedef struct cmm_config {
+   int            npages;           // initial heap size in pages
+   notify_func_t *notify;           // notification function
+   FILE          *log;              // debug log, cmm_init_ex: enables debug code
+   size_t         max_heap;         // address space reserved for the heap
+   long           block_trigger;    // blocks taken between collects, 0: paced
+                                    // or from the heap size
+   size_t         volume_trigger;   // bytes allocated between collects, 0: paced
+                                    // or from the heap size
+   int            gc_percent;       // 0: no pacing (default), see cmm_gc_percent
+   size_t         soft_max_heap;    // limit of the paced heap goal, 0: none
+   int            mark_stack;       // initial marking stack entries, rounded
+                                    // up to a power of two, at most 2^26
+   int            idle_calls;       // cmm_idle calls between idle collects
+   int            mark_threads;     // see cmm_mark_threads
+   size_t         large_threshold;  // see cmm_large_threshold
+   size_t         retain_free;      // see cmm_retain_free
+   int            huge_pages;       // see cmm_huge_pages
+   int            mode;             // enum cmm_mode
+   long           max_pause_us;     // incremental marking slice, microseconds
+   size_t         block_size;       // heap block bytes, a power of two
+                                    // from 4 KB to 256 KB
+} cmm_config_t;
+
 /* Administration */
 void    cmm_init(int, notify_func_t *, FILE *); // initialize manager
+void    cmm_config_defaults(cmm_config_t *);  // fill in default settings
+void    cmm_init_ex(const cmm_config_t *); // initialize manager
+int     cmm_huge_pages(int);              // huge pages for new heaps, return previous
 void    cmm_debug(bool);                  // enable/disable debug code
 mt_t    cmm_regtype(const char *, size_t, clear_func_t, mark_func_t *, finalize_func_t *);
 void    cmm_root(const void *);           // add a root location
 void    cmm_unroot(const void *);         // remove a root location
 bool    cmm_idle(void);                   // do work, return true when more work
 
+/* Threads */
+void    cmm_thread_register(void);        // calling thread may use LIBCMM
+void    cmm_thread_unregister(void);      // calling thread is done with LIBCMM
+void    cmm_safepoint(void);              // let a pending collection proceed
+void    cmm_begin_blocking(void);         // thread may block, collections proceed
+void    cmm_end_blocking(void);           // thread is back, waits for collection
+
+/* Heaps (all other functions work on the calling thread's heap, */
+/* types are registered per heap, pointers between heaps are not */
+/* followed by the collector)                                    */
+cmm_heap_t *cmm_heap_create(int, notify_func_t *, FILE *); // create another heap
+cmm_heap_t *cmm_heap_create_ex(const cmm_config_t *); // create another heap
+void    cmm_heap_destroy(cmm_heap_t *);   // free heap and all objects in it
+cmm_heap_t *cmm_heap_select(cmm_heap_t *); // use heap (NULL: default), return previous
+cmm_heap_t *cmm_heap_current(void);       // heap used by calling thread
+
 /* Garbage collection */
 int     cmm_collect_now(void);            // trigger garbage collection
 bool    cmm_collect_in_progress(void);    // true if gc is under way
+int     cmm_mark_threads(int);            // set number of GC threads, return previous
+size_t  cmm_retain_free(size_t);          // set free heap bytes kept, return previous
+int     cmm_gc_percent(int);              // set allocation between collects in % of live, return previous
 
 /* Allocation functions */
 void   *cmm_alloc(mt_t);                  // allocate fixed-size object
@@ -125,6 +194,8 @@ void   *cmm_allocv(mt_t, size_t);         // allocate variable-sized object
 void   *cmm_malloc(mt_t, size_t);         // allocate variable-sized object
 void   *cmm_blob(size_t);                 // allocate blob of size
 char   *cmm_strdup(C99_CONST char *);         // create managed copy of string
+void   *cmm_realloc(void *, size_t);      // resize variable-sized object
+size_t  cmm_large_threshold(size_t);      // set size of large objects, return previous
 
 /* Properties of managed objects */
 bool    cmm_ismanaged(C99_CONST void *);      // true if managed object
@@ -155,6 +226,16 @@ char  **cmm_prof_key(void);               // make key for profile data
 #define CMM_NOGC_END             cmm_end_nogc(__cmm_nogc)
 #define CMM_PAUSEGC              bool __cmm_pausegc = cmm_begin_nogc(true)
 #define CMM_PAUSEGC_END          cmm_end_nogc(__cmm_pausegc)
+#define CMM_SAFEPOINT            { if (__atomic_load_n(&_cmm_stop_requested, __ATOMIC_ACQUIRE)) \
+                                     cmm_safepoint(); }
+
+/* o->f = v for a pointer v to a managed object; plain stores  */
+/* are fine into objects reachable through anchors only, e.g.   */
+/* while initializing them, and in sync, snapshot and mostly    */
+/* concurrent heaps                                             */
+#define CMM_WRITE(o, f, v)       { __typeof__((o)->f) __v = (v); \
+                                   C99_CONST void *__old = (o)->f; \
+                                   (o)->f = __v; _cmm_write((o), __old, __v); }
 
 void    cmm_anchor(C99_CONST void *);
 bool    cmm_begin_nogc(bool);
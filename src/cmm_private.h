@@ -10,7 +10,10 @@ struct cmm_stack {
    const void  **sp_max;
 };
 
-extern struct cmm_stack *const _cmm_transients;
+extern CMM_TLS struct cmm_stack *_cmm_transients;
+/* set by other threads, read with __atomic_load_n */
+extern bool _cmm_stop_requested;
+extern int _cmm_marking;
 
 // jea comment & replace st with _cmm_transients
 /* #define st _cmm_transients */
@@ -39,6 +42,63 @@ STATICFUNC inline void _cmm_end_anchored(C99_CONST void **sp)
 // jea comment
 /* #undef st */ 
 
+/* allocation cursor, see struct cursor in cmm.cpp */
+struct cmm_cursor {
+   char          *a;
+   char          *end;
+   size_t         size;
+   clear_func_t  *clear;
+   uintptr_t      _current_a;
+   uintptr_t      _current_amax;
+   long           _current_b;
+};
+
+/* heap map geometry, must agree with HBLOCK in cmm.cpp: per   */
+/* block, a plane of managed bits followed by two others; the  */
+/* blocks of the heap in use are 2^_cmm_block_bits bytes       */
+#define _CMM_ALIGN_NUM_BITS  3
+#define _CMM_HMAP_EPI        ((int)(sizeof(unsigned int)*8))
+#define _CMM_HMAP_EPI_BITS   (sizeof(unsigned int) == 8 ? 6 : sizeof(unsigned int) == 4 ? 5 : 4)
+#define _CMM_HMAP_PLANES     3
+#define _CMM_CARD_SHIFT      9     /* 512 byte cards */
+
+/* Fast path of cmm_alloc: take the next object from the run
+ * of free objects cached for type t by the calling thread and
+ * flag it as managed. Everything else is left to cmm_alloc proper.
+ */
+STATICFUNC inline void *_cmm_alloc(mt_t t)
+{
+   extern void *cmm_alloc(mt_t);
+   extern CMM_TLS struct cmm_cursor *_cmm_cursors;
+   extern CMM_TLS int _cmm_num_cursors;
+   extern CMM_TLS char *_cmm_heap;
+   extern CMM_TLS unsigned int *_cmm_hmap;
+   extern CMM_TLS int _cmm_block_bits;
+
+   if ((unsigned)t >= (unsigned)_cmm_num_cursors)
+      return cmm_alloc(t);
+   struct cmm_cursor *c = _cmm_cursors + t;
+   if (c->a >= c->end)
+      return cmm_alloc(t);
+
+   char *p = c->a;
+   c->a += c->size;
+   if (c->clear)
+      c->clear(p, c->size);
+
+   /* word h/EPI if a block's planes were one, plus the two */
+   /* other planes of each block before p's                  */
+   uintptr_t h = ((uintptr_t)(p - _cmm_heap)) >> _CMM_ALIGN_NUM_BITS;
+   int wpb_bits = _cmm_block_bits - _CMM_ALIGN_NUM_BITS - _CMM_HMAP_EPI_BITS;
+   _cmm_hmap[h/_CMM_HMAP_EPI +
+             ((_CMM_HMAP_PLANES - 1)*(h >> (wpb_bits + _CMM_HMAP_EPI_BITS)) << wpb_bits)]
+      |= 1u << (h % _CMM_HMAP_EPI);
+   _cmm_anchor(p);
+   return p;
+}
+
+#define cmm_alloc(t)   _cmm_alloc(t)
+
 STATICFUNC inline void _cmm_mark(C99_CONST void *p)
 {
    extern const bool cmm_debug_enabled;
@@ -48,6 +108,31 @@ STATICFUNC inline void _cmm_mark(C99_CONST void *p)
    _cmm_push(p);
 }
 
+/* write barrier of CMM_WRITE storing p over old: a generational  */
+/* heap remembers the card of o, or o itself when it is malloc'ed, */
+/* so a minor collect finds old objects pointing to new ones;      */
+/* while a heap is marking in slices, p must not stay white behind */
+/* a black object, and while it marks concurrently, old must not   */
+/* escape the snapshot                                             */
+STATICFUNC inline void _cmm_write(C99_CONST void *o, C99_CONST void *old,
+                                  C99_CONST void *p)
+{
+   extern CMM_TLS char *_cmm_heap;
+   extern CMM_TLS unsigned char *_cmm_cards;
+   extern CMM_TLS size_t _cmm_num_cards;
+   extern void _cmm_shade(C99_CONST void *, C99_CONST void *);
+   extern void _cmm_remember(C99_CONST void *);
+
+   uintptr_t c = ((uintptr_t)((char *)o - _cmm_heap)) >> _CMM_CARD_SHIFT;
+   if (_cmm_cards) {
+      if (c < _cmm_num_cards)
+         _cmm_cards[c] = 1;
+      else
+         _cmm_remember(o);
+   }
+   if (__atomic_load_n(&_cmm_marking, __ATOMIC_ACQUIRE)) _cmm_shade(old, p);
+}
+
 
 /* -------------------------------------------------------------
    Local Variables: